@@ -32,66 +32,626 @@ SOFTWARE.
 
 
 #include <math.h>
+#include <nux/nux.h>
+#include <nuxcompute.h>
 #include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
 
 #include "util.h"
 #include "cgpt-common.h"
+#include "cgpt-2.h"
+
+#define NUXPERF_DECLARE
+#include "cgpt-perf.h"
+#include "cgpt-gemv.h"
+#include "cgpt-exec.h"
+#include "cgpt-gemm.h"
+#include "cgpt-ggml.h"
+
+/*
+  Reallocate 'kv' with 'n_ctx' rows per layer, keeping its first
+  'n_past' rows.
+*/
+bool gpt2_kv_resize(struct gpt2_kv_cache *kv, const int n_past, const int n_ctx)
+{
+  const size_t esize = ggml_type_size(kv->type);
+  const size_t row = esize*kv->n_embd;
+  const int64_t n_elements = (int64_t)kv->n_embd*kv->n_layer*n_ctx;
+  struct ggml_context *ctx;
+  struct ggml_tensor *k, *v;
+
+  struct ggml_init_params params = {
+    /*.mem_size   =*/ 2*ggml_row_size(kv->type, n_elements) + 2*ggml_tensor_overhead(),
+    /*.mem_buffer =*/ NULL,
+    /*.no_alloc   =*/ false,
+  };
+
+  ctx = ggml_init(params);
+  if (!ctx) {
+    fprintf(stderr, "%s: ggml_init() failed for %d rows\n", __func__, n_ctx);
+    return false;
+  }
+  k = ggml_new_tensor_1d(ctx, kv->type, n_elements);
+  v = ggml_new_tensor_1d(ctx, kv->type, n_elements);
+
+  for (int il = 0; il < kv->n_layer && n_past > 0; il++) {
+    memcpy((char *)k->data + row*il*n_ctx, (char *)kv->k->data + row*il*kv->n_ctx, n_past*row);
+
+    if (kv->v_trans) {
+      // [n_ctx, n_embd] per layer, rows of different length
+      for (int d = 0; d < kv->n_embd; d++)
+	memcpy((char *)v->data + esize*((size_t)il*n_ctx*kv->n_embd + (size_t)d*n_ctx),
+	       (char *)kv->v->data + esize*((size_t)il*kv->n_ctx*kv->n_embd + (size_t)d*kv->n_ctx),
+	       n_past*esize);
+    } else {
+      memcpy((char *)v->data + row*il*n_ctx, (char *)kv->v->data + row*il*kv->n_ctx, n_past*row);
+    }
+  }
+
+  if (kv->ctx)
+    ggml_free(kv->ctx);
+  kv->ctx = ctx;
+  kv->k = k;
+  kv->v = v;
+  kv->n_ctx = n_ctx;
+  nuxperf_inc(&gpt2_kv_resizes);
+  return true;
+}
+
+/*
+  Initialize an empty key + value memory of up to 'n_ctx_max' rows per
+  layer, in the layout selected by the model flags. ggml_flash_attn_ext
+  wants F16 keys and values.
+*/
+bool gpt2_kv_init(const struct gpt2_model *model, const int n_ctx_max, struct gpt2_kv_cache *kv)
+{
+  kv->ctx = NULL;
+  kv->k = NULL;
+  kv->v = NULL;
+  kv->type = model->flash_attn ? GGML_TYPE_F16 : GGML_TYPE_F32;
+  kv->n_ctx = 0;
+  kv->n_ctx_max = n_ctx_max;
+  kv->n_embd = model->hparams.n_embd;
+  kv->n_layer = model->hparams.n_layer;
+  kv->v_trans = model->v_trans;
+
+  return gpt2_kv_resize(kv, 0, n_ctx_max < GPT2_KV_CHUNK ? n_ctx_max : GPT2_KV_CHUNK);
+}
+
+/*
+  Make room for 'n' rows per layer, 'n_past' of which are in use.
+*/
+bool gpt2_kv_reserve(struct gpt2_kv_cache *kv, const int n_past, const int n)
+{
+  int n_ctx;
+
+  if (n <= kv->n_ctx)
+    return true;
+  if (n > kv->n_ctx_max) {
+    fprintf(stderr, "%s: %d rows exceed n_ctx = %d\n", __func__, n, kv->n_ctx_max);
+    return false;
+  }
+
+  n_ctx = GGML_PAD(n, GPT2_KV_CHUNK);
+  return gpt2_kv_resize(kv, n_past, n_ctx < kv->n_ctx_max ? n_ctx : kv->n_ctx_max);
+}
+
+/*
+  Give back the memory not needed by the first 'n_past' rows.
+*/
+void gpt2_kv_shrink(struct gpt2_kv_cache *kv, const int n_past)
+{
+  int n_ctx = GGML_PAD(n_past > 0 ? n_past : 1, GPT2_KV_CHUNK);
+
+  n_ctx = n_ctx < kv->n_ctx_max ? n_ctx : kv->n_ctx_max;
+  if (n_ctx < kv->n_ctx)
+    gpt2_kv_resize(kv, n_past, n_ctx);
+}
+
+void gpt2_kv_free(struct gpt2_kv_cache *kv)
+{
+  if (kv->ctx)
+    ggml_free(kv->ctx);
+  kv->ctx = NULL;
+  kv->k = NULL;
+  kv->v = NULL;
+}
+
+/*
+  Size of 'n' rows of every layer, keys and values.
+*/
+size_t gpt2_kv_rows_size(const struct gpt2_kv_cache *kv, const int n)
+{
+  return 2*(size_t)kv->n_layer*n*ggml_row_size(kv->k->type, kv->n_embd);
+}
+
+/*
+  Copy rows [p0, p0 + n) of every layer from the KV memory to 'buf'
+  or, if 'write', from 'buf' to the KV memory. 'buf' is laid out as
+  [n_layer][K, V][n][n_embd] whatever the V layout in memory.
+*/
+void gpt2_kv_rows(const struct gpt2_kv_cache *kv, const int p0, const int n, void *buf, bool write)
+{
+  const size_t esize = ggml_element_size(kv->k);
+  const size_t row = esize*kv->n_embd;
+  char *b = buf;
+
+#define KV_COPY(_mem, _buf, _size) do {		\
+    if (write)					\
+      memcpy((_mem), (_buf), (_size));		\
+    else					\
+      memcpy((_buf), (_mem), (_size));		\
+  } while (0)
+
+  for (int il = 0; il < kv->n_layer; il++) {
+    char *k = (char *)kv->k->data + row*((size_t)il*kv->n_ctx + p0);
+
+    KV_COPY(k, b, n*row);
+    b += n*row;
+
+    if (kv->v_trans) {
+      // [n_ctx, n_embd] per layer
+      char *v = (char *)kv->v->data + esize*((size_t)il*kv->n_ctx*kv->n_embd + p0);
+
+      for (int d = 0; d < kv->n_embd; d++)
+	for (int i = 0; i < n; i++)
+	  KV_COPY(v + esize*((size_t)d*kv->n_ctx + i), b + esize*((size_t)i*kv->n_embd + d), esize);
+    } else {
+      char *v = (char *)kv->v->data + row*((size_t)il*kv->n_ctx + p0);
+
+      KV_COPY(v, b, n*row);
+    }
+    b += n*row;
+  }
+#undef KV_COPY
+}
+
+/*
+  Context shift: drop rows [n_keep, n_keep + n_discard) of the first
+  'n_past' rows and move the rest down, so that a sequence can go on
+  past n_ctx with the same memory. The first n_keep rows are attention
+  sinks and stay.
+
+  GPT-2 adds absolute position embeddings at the input, so the rows
+  kept still carry the positions they were computed at: there is
+  nothing like a RoPE rotation to redo. New tokens continue at the
+  shifted n_past.
+*/
+void gpt2_kv_shift(struct gpt2_kv_cache *kv, const int n_keep, const int n_discard, const int n_past)
+{
+  const size_t esize = ggml_element_size(kv->k);
+  const size_t row = esize*kv->n_embd;
+  const int n_move = n_past - n_keep - n_discard;
+
+  for (int il = 0; il < kv->n_layer; il++) {
+    char *k = (char *)kv->k->data + row*((size_t)il*kv->n_ctx + n_keep);
+
+    memmove(k, k + n_discard*row, n_move*row);
+
+    if (kv->v_trans) {
+      // [n_ctx, n_embd] per layer
+      char *v = (char *)kv->v->data + esize*((size_t)il*kv->n_ctx*kv->n_embd + n_keep);
+
+      for (int d = 0; d < kv->n_embd; d++)
+	memmove(v + esize*(size_t)d*kv->n_ctx, v + esize*((size_t)d*kv->n_ctx + n_discard), n_move*esize);
+    } else {
+      char *v = (char *)kv->v->data + row*((size_t)il*kv->n_ctx + n_keep);
+
+      memmove(v, v + n_discard*row, n_move*row);
+    }
+  }
+  nuxmeasure_add(&gpt2_ctx_shift_tokens, n_discard);
+}
+
+/*
+  Prefix cache.
+
+  A radix tree over token sequences. Each node holds the key and value
+  rows of the tokens on its edge, as gpt2_kv_rows() lays them out.
+  Those rows only depend on the tokens on the path from the root, so a
+  sequence whose prompt starts with a cached prefix copies them into
+  its KV memory and starts evaluating right after it.
+
+  When the rows stored exceed 'max_size' bytes, leaves are evicted
+  least recently used first.
+*/
+struct gpt2_prefix_node {
+  struct gpt2_prefix_node *parent;
+  struct gpt2_prefix_node *child;
+  struct gpt2_prefix_node *sibling;
+
+  int32_t *tokens;
+  int n_tokens;
+  char *rows;
+
+  uint64_t last_use;
+};
+
+struct gpt2_prefix_cache {
+  struct gpt2_prefix_node root;
+
+  size_t row;   /* Bytes of one K or V row of one layer. */
+  int n_blocks; /* K and V of every layer. */
+
+  size_t size;
+  size_t max_size;
+  uint64_t clock;
+};
+
+void gpt2_prefix_init(struct gpt2_prefix_cache *pc, const struct gpt2_kv_cache *kv, const size_t max_size)
+{
+  memset(pc, 0, sizeof(*pc));
+  pc->row = ggml_row_size(kv->k->type, kv->n_embd);
+  pc->n_blocks = 2*kv->n_layer;
+  pc->max_size = max_size;
+}
+
+/*
+  Copy the rows of tokens [from, from + n) of 'node' to 'out'.
+*/
+static void
+gpt2_prefix_slice(const struct gpt2_prefix_cache *pc, const struct gpt2_prefix_node *node,
+		  const int from, const int n, char *out)
+{
+  for (int b = 0; b < pc->n_blocks; b++)
+    memcpy(out + b*n*pc->row, node->rows + (b*(size_t)node->n_tokens + from)*pc->row, n*pc->row);
+}
+
+static struct gpt2_prefix_node *
+gpt2_prefix_new(struct gpt2_prefix_cache *pc, struct gpt2_prefix_node *parent,
+		const int32_t *tokens, const int n)
+{
+  struct gpt2_prefix_node *node = calloc(1, sizeof(*node));
+
+  node->parent = parent;
+  node->sibling = parent->child;
+  parent->child = node;
+  node->tokens = malloc(n*sizeof(int32_t));
+  memcpy(node->tokens, tokens, n*sizeof(int32_t));
+  node->n_tokens = n;
+  node->rows = malloc(pc->n_blocks*n*pc->row);
+  pc->size += pc->n_blocks*n*pc->row;
+  return node;
+}
+
+/*
+  Split 'node' after its first 'n' tokens, returning the new parent.
+*/
+static struct gpt2_prefix_node *
+gpt2_prefix_split(struct gpt2_prefix_cache *pc, struct gpt2_prefix_node *node, const int n)
+{
+  struct gpt2_prefix_node *parent = node->parent;
+  struct gpt2_prefix_node **pp;
+  struct gpt2_prefix_node *head;
+  char *rows;
+
+  /* Unlink 'node', the new head takes its place. */
+  for (pp = &parent->child; *pp != node; pp = &(*pp)->sibling)
+    ;
+  *pp = node->sibling;
+
+  head = gpt2_prefix_new(pc, parent, node->tokens, n);
+  gpt2_prefix_slice(pc, node, 0, n, head->rows);
+  head->last_use = node->last_use;
+
+  rows = malloc(pc->n_blocks*(node->n_tokens - n)*pc->row);
+  gpt2_prefix_slice(pc, node, n, node->n_tokens - n, rows);
+  free(node->rows);
+  node->rows = rows;
+  memmove(node->tokens, node->tokens + n, (node->n_tokens - n)*sizeof(int32_t));
+  node->n_tokens -= n;
+  pc->size -= pc->n_blocks*n*pc->row;
+
+  node->parent = head;
+  node->sibling = NULL;
+  head->child = node;
+  return head;
+}
+
+static int
+gpt2_prefix_common(const struct gpt2_prefix_node *node, const int32_t *tokens, const int n)
+{
+  int i;
+
+  for (i = 0; i < node->n_tokens && i < n; i++)
+    if (node->tokens[i] != tokens[i])
+      break;
+  return i;
+}
+
+static struct gpt2_prefix_node *
+gpt2_prefix_find_child(struct gpt2_prefix_node *node, const int32_t token)
+{
+  for (node = node->child; node != NULL; node = node->sibling)
+    if (node->tokens[0] == token)
+      return node;
+  return NULL;
+}
+
+/*
+  Evict least recently used leaves until the cache fits, never
+  evicting 'keep' or its ancestors.
+*/
+static void
+gpt2_prefix_evict(struct gpt2_prefix_cache *pc, const struct gpt2_prefix_node *keep)
+{
+  while (pc->size > pc->max_size) {
+    struct gpt2_prefix_node *lru = NULL;
+    struct gpt2_prefix_node *node = pc->root.child;
+    struct gpt2_prefix_node **pp;
+
+    /* Depth first walk over the leaves. */
+    while (node != NULL) {
+      if (node->child) {
+	node = node->child;
+	continue;
+      }
+      if (node != keep && (lru == NULL || node->last_use < lru->last_use))
+	lru = node;
+      while (node != &pc->root && node->sibling == NULL)
+	node = node->parent;
+      node = node == &pc->root ? NULL : node->sibling;
+    }
+    if (lru == NULL)
+      return;
+
+    for (pp = &lru->parent->child; *pp != lru; pp = &(*pp)->sibling)
+      ;
+    *pp = lru->sibling;
+    pc->size -= pc->n_blocks*lru->n_tokens*pc->row;
+    free(lru->rows);
+    free(lru->tokens);
+    free(lru);
+  }
+}
+
+void gpt2_prefix_free(struct gpt2_prefix_cache *pc)
+{
+  pc->max_size = 0;
+  gpt2_prefix_evict(pc, NULL);
+}
+
+/*
+  Copy into 'kv' the rows of the longest cached prefix of 'tokens', at
+  most 'n' long, and return its length.
+*/
+int gpt2_prefix_lookup(struct gpt2_prefix_cache *pc, struct gpt2_kv_cache *kv,
+		       const int32_t *tokens, const int n)
+{
+  struct gpt2_prefix_node *node = &pc->root;
+  int n_match = 0;
+
+  nuxperf_inc(&gpt2_prefix_lookups);
+  pc->clock++;
+
+  while (n_match < n) {
+    struct gpt2_prefix_node *child = gpt2_prefix_find_child(node, tokens[n_match]);
+    int m;
+
+    if (child == NULL)
+      break;
+
+    m = gpt2_prefix_common(child, tokens + n_match, n - n_match);
+    if (m == child->n_tokens) {
+      gpt2_kv_rows(kv, n_match, m, child->rows, true);
+    } else {
+      char *rows = malloc(pc->n_blocks*m*pc->row);
+
+      gpt2_prefix_slice(pc, child, 0, m, rows);
+      gpt2_kv_rows(kv, n_match, m, rows, true);
+      free(rows);
+    }
+    child->last_use = pc->clock;
+    n_match += m;
+    if (m < child->n_tokens)
+      break;
+    node = child;
+  }
+
+  if (n_match) {
+    nuxperf_inc(&gpt2_prefix_hits);
+    nuxmeasure_add(&gpt2_prefix_saved_tokens, n_match);
+  }
+  return n_match;
+}
+
+/*
+  Cache the rows of 'tokens', evaluated at positions [0, n) of 'kv'.
+*/
+void gpt2_prefix_insert(struct gpt2_prefix_cache *pc, const struct gpt2_kv_cache *kv,
+			const int32_t *tokens, const int n)
+{
+  struct gpt2_prefix_node *node = &pc->root;
+  int n_match = 0;
+
+  if (pc->max_size < pc->n_blocks*n*pc->row)
+    return;
+
+  pc->clock++;
+  while (n_match < n) {
+    struct gpt2_prefix_node *child = gpt2_prefix_find_child(node, tokens[n_match]);
+    int m;
+
+    if (child == NULL) {
+      child = gpt2_prefix_new(pc, node, tokens + n_match, n - n_match);
+      gpt2_kv_rows(kv, n_match, n - n_match, child->rows, false);
+      child->last_use = pc->clock;
+      node = child;
+      break;
+    }
+
+    m = gpt2_prefix_common(child, tokens + n_match, n - n_match);
+    if (m < child->n_tokens)
+      child = gpt2_prefix_split(pc, child, m);
+    child->last_use = pc->clock;
+    n_match += m;
+    node = child;
+  }
+
+  gpt2_prefix_evict(pc, node);
+}
+
+/*
+  KV snapshots.
 
-// default hparams (GPT-2 117M)
-struct gpt2_hparams {
+  A snapshot holds the first n_past rows of a KV memory and the tokens
+  they were computed from, so that a sequence can be parked and resumed
+  later without evaluating its context again. The blob is position
+  independent: it can live in a buffer, a preallocated memory region or
+  a payload mapped at boot.
+
+  Rows are stored as gpt2_kv_rows() lays them out, converted to 'type':
+  F32, F16 or a quantized type such as Q8_0 to save space at the cost of
+  some precision.
+*/
+#define GPT2_KV_MAGIC 0x67326b76 /* "g2kv" */
+
+struct gpt2_kv_header {
+  uint32_t magic;
   int32_t n_vocab;
-  int32_t n_ctx;
   int32_t n_embd;
   int32_t n_head;
   int32_t n_layer;
-  int32_t ftype;
-  float   eps;
+  int32_t type;   /* ggml_type of the rows. */
+  int32_t n_past; /* Tokens, then rows per layer for K and for V. */
 };
 
-struct gpt2_layer {
-    // normalization
-    struct ggml_tensor * ln_1_g;
-    struct ggml_tensor * ln_1_b;
+size_t gpt2_kv_snapshot_size(const struct gpt2_kv_cache *kv, const int n_past, enum ggml_type type)
+{
+  return sizeof(struct gpt2_kv_header) + n_past*sizeof(int32_t)
+    + 2*(size_t)kv->n_layer*n_past*ggml_row_size(type, kv->n_embd);
+}
 
-    struct ggml_tensor * ln_2_g;
-    struct ggml_tensor * ln_2_b;
+/*
+  Write rows [0, n_past) of 'kv', computed from 'tokens', to 'buf'.
+*/
+bool gpt2_kv_snapshot(const struct gpt2_model *model, const struct gpt2_kv_cache *kv,
+		      const int32_t *tokens, const int n_past, enum ggml_type type,
+		      void *buf, size_t size)
+{
+  const ggml_type_traits_t src = ggml_internal_get_type_traits(kv->k->type);
+  const size_t src_row = ggml_row_size(kv->k->type, kv->n_embd);
+  const size_t dst_row = ggml_row_size(type, kv->n_embd);
+  const size_t n_rows = 2*(size_t)kv->n_layer*n_past;
+  struct gpt2_kv_header *hdr = buf;
+  char *rows, *dst;
+  float *row;
+
+  if (n_past > kv->n_ctx || kv->n_embd % ggml_blck_size(type)
+      || size < gpt2_kv_snapshot_size(kv, n_past, type)) {
+    fprintf(stderr, "%s: cannot store %d rows as %s in %zu bytes\n", __func__,
+	    n_past, ggml_type_name(type), size);
+    return false;
+  }
 
-    // attention
-    struct ggml_tensor * c_attn_attn_w;
-    struct ggml_tensor * c_attn_attn_b;
+  hdr->magic = GPT2_KV_MAGIC;
+  hdr->n_vocab = model->hparams.n_vocab;
+  hdr->n_embd = model->hparams.n_embd;
+  hdr->n_head = model->hparams.n_head;
+  hdr->n_layer = model->hparams.n_layer;
+  hdr->type = type;
+  hdr->n_past = n_past;
+  memcpy(hdr + 1, tokens, n_past*sizeof(int32_t));
+  dst = (char *)(hdr + 1) + n_past*sizeof(int32_t);
+
+  rows = malloc(n_rows*src_row);
+  row = malloc(kv->n_embd*sizeof(float));
+  gpt2_kv_rows(kv, 0, n_past, rows, false);
+
+  for (size_t i = 0; i < n_rows; i++, dst += dst_row) {
+    const char *r = rows + i*src_row;
+
+    if (kv->k->type == type) {
+      memcpy(dst, r, dst_row);
+      continue;
+    }
 
-    struct ggml_tensor * c_attn_proj_w;
-    struct ggml_tensor * c_attn_proj_b;
+    if (kv->k->type == GGML_TYPE_F32)
+      memcpy(row, r, src_row);
+    else
+      src.to_float(r, row, kv->n_embd);
+
+    if (type == GGML_TYPE_F32)
+      memcpy(dst, row, dst_row);
+    else if (type == GGML_TYPE_F16)
+      ggml_fp32_to_fp16_row(row, (ggml_fp16_t *)dst, kv->n_embd);
+    else
+      ggml_quantize_chunk(type, row, dst, 0, 1, kv->n_embd, NULL);
+  }
 
-    // mlp
-    struct ggml_tensor * c_mlp_fc_w;
-    struct ggml_tensor * c_mlp_fc_b;
+  free(row);
+  free(rows);
+  return true;
+}
 
-    struct ggml_tensor * c_mlp_proj_w;
-    struct ggml_tensor * c_mlp_proj_b;
-};
+/*
+  Load a snapshot into 'kv'. Returns n_past, or -1 if the blob does not
+  match the model. If 'tokens' is not NULL, it points to the tokens of
+  the snapshot on return.
+*/
+int gpt2_kv_restore(const struct gpt2_model *model, struct gpt2_kv_cache *kv,
+		    const void *buf, size_t size, const int32_t **tokens)
+{
+  const struct gpt2_kv_header *hdr = buf;
+  const size_t dst_row = ggml_row_size(kv->k->type, kv->n_embd);
+  ggml_type_traits_t src;
+  size_t src_row, n_rows;
+  const char *s;
+  char *rows;
+  float *row;
+
+  if (size < sizeof(*hdr) || hdr->magic != GPT2_KV_MAGIC
+      || hdr->n_vocab != model->hparams.n_vocab || hdr->n_embd != kv->n_embd
+      || hdr->n_head != model->hparams.n_head || hdr->n_layer != kv->n_layer
+      || hdr->type < 0 || hdr->type >= GGML_TYPE_COUNT || ggml_blck_size(hdr->type) <= 0
+      || kv->n_embd % ggml_blck_size(hdr->type)
+      || (hdr->type != GGML_TYPE_F32 && !ggml_internal_get_type_traits(hdr->type).to_float)
+      || hdr->n_past < 0 || hdr->n_past > kv->n_ctx_max
+      || size < gpt2_kv_snapshot_size(kv, hdr->n_past, hdr->type)) {
+    fprintf(stderr, "%s: invalid KV snapshot\n", __func__);
+    return -1;
+  }
 
-struct gpt2_model {
-    struct gpt2_hparams hparams;
+  if (!gpt2_kv_reserve(kv, 0, hdr->n_past))
+    return -1;
 
-    // normalization
-    struct ggml_tensor * ln_f_g;
-    struct ggml_tensor * ln_f_b;
+  src = ggml_internal_get_type_traits(hdr->type);
+  src_row = ggml_row_size(hdr->type, kv->n_embd);
+  n_rows = 2*(size_t)kv->n_layer*hdr->n_past;
+  s = (const char *)(hdr + 1) + hdr->n_past*sizeof(int32_t);
 
-    struct ggml_tensor * wte;     // position embedding
-    struct ggml_tensor * wpe;     //    token embedding
-    struct ggml_tensor * lm_head; // language model head
+  rows = malloc(n_rows*dst_row);
+  row = malloc(kv->n_embd*sizeof(float));
 
-    struct gpt2_layer *layers;
+  for (size_t i = 0; i < n_rows; i++, s += src_row) {
+    char *dst = rows + i*dst_row;
 
-    // key + value memory
-    struct ggml_tensor * memory_k;
-    struct ggml_tensor * memory_v;
+    if (hdr->type == kv->k->type) {
+      memcpy(dst, s, dst_row);
+      continue;
+    }
 
-    //
-    struct ggml_context * ctx_w;
-    struct hashmap tensors;
-};
+    if (hdr->type == GGML_TYPE_F32)
+      memcpy(row, s, src_row);
+    else
+      src.to_float(s, row, kv->n_embd);
+
+    if (kv->k->type == GGML_TYPE_F32)
+      memcpy(dst, row, dst_row);
+    else
+      ggml_fp32_to_fp16_row(row, (ggml_fp16_t *)dst, kv->n_embd);
+  }
+
+  gpt2_kv_rows(kv, 0, hdr->n_past, rows, true);
+  free(row);
+  free(rows);
+
+  if (tokens)
+    *tokens = (const int32_t *)(hdr + 1);
+  printf("%s: restored %d rows from %s\n", __func__, hdr->n_past, ggml_type_name(hdr->type));
+  return hdr->n_past;
+}
 
 bool gpt2_model_load(void *buf, size_t size, struct gpt2_model *model, struct vocab *v)
 {
@@ -168,6 +728,10 @@ bool gpt2_model_load(void *buf, size_t size, struct gpt2_model *model, struct vo
       return false;
     }
 
+  /* ggml_flash_attn_ext wants values not transposed. */
+  if (model->flash_attn)
+    model->v_trans = false;
+
   struct gpt2_hparams  hparams = model->hparams;
   size_t ctx_size = 0;
   {
@@ -201,8 +765,6 @@ bool gpt2_model_load(void *buf, size_t size, struct gpt2_model *model, struct vo
     ctx_size += n_layer*(ggml_row_size(wtype,         4*n_embd*n_embd)); // c_mlp_proj_w
     ctx_size += n_layer*(ggml_row_size(GGML_TYPE_F32, 4*n_embd));        // c_mlp_proj_b
 
-    ctx_size += n_ctx*n_layer*ggml_row_size(GGML_TYPE_F32, n_embd); // memory_k
-    ctx_size += n_ctx*n_layer*ggml_row_size(GGML_TYPE_F32, n_embd); // memory_v
 
     ctx_size += (6 + 12*n_layer)*512; // object overhead
 
@@ -298,20 +860,13 @@ bool gpt2_model_load(void *buf, size_t size, struct gpt2_model *model, struct vo
 
   /* key + value memory */
   {
-    const int n_embd  = hparams.n_embd;
-    const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
-
-    const int n_mem      = n_layer*n_ctx;
-    const int n_elements = n_embd*n_mem;
-
-    model->memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
-    model->memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_elements);
+    if (!gpt2_kv_init(model, hparams.n_ctx, &model->kv))
+      return false;
 
-    const size_t memory_size = ggml_nbytes(model->memory_k)
-      + ggml_nbytes(model->memory_v);
+    const size_t memory_size = ggml_nbytes(model->kv.k) + ggml_nbytes(model->kv.v);
 
-    printf("%s: memory size = %8.2f MB, n_mem = %d\n", __func__, memory_size/1024.0/1024.0, n_mem);
+    printf("%s: memory size = %8.2f MB, n_ctx = %d, grows up to n_ctx = %d\n", __func__,
+	   memory_size/1024.0/1024.0, model->kv.n_ctx, model->kv.n_ctx_max);
   }
 
   /* load weights */
@@ -395,134 +950,330 @@ bool gpt2_model_load(void *buf, size_t size, struct gpt2_model *model, struct vo
     printf("%s: model size  = %8.2f (%ld) MB\n", __func__, total_size/1024.0/1024.0, total_size>>20);
   }
 
+  model->folded = false;
   return true;
 }
 
-bool gpt2_eval(const struct gpt2_model *model,
-	       const int n_threads,
-	       const int n_past,
-	       int32_t *embd_inp,
-	       int embd_inp_count,
-	       struct fvec *embd_w,
-	       size_t *mem_per_token)
+/*
+  Replace W*(g*x + b) + c with (W*diag(g))*x + (W*b + c), and scale the
+  first 'n_scaled' output rows (weights and bias) by 'scale'.
+*/
+static void
+gpt2_fold_affine(struct ggml_tensor *w, struct ggml_tensor *c,
+		 const struct ggml_tensor *g, const struct ggml_tensor *b,
+		 int n_scaled, float scale)
 {
-  const int N = embd_inp_count;
-  struct gpt2_hparams hparams = model->hparams;
+  const int n_in  = w->ne[0];
+  const int n_out = w->ne[1];
+  const float *gd = (const float *)g->data;
+  const float *bd = (const float *)b->data;
+  float *cd = (float *)c->data;
+  float *row = malloc(n_in * sizeof(float));
+
+  for (int j = 0; j < n_out; j++) {
+    void *wrow = (char *)w->data + j*w->nb[1];
+    const float s = j < n_scaled ? scale : 1.0f;
+    double acc = 0.0;
+
+    if (w->type == GGML_TYPE_F16)
+      ggml_fp16_to_fp32_row((ggml_fp16_t *)wrow, row, n_in);
+    else
+      memcpy(row, wrow, n_in * sizeof(float));
+
+    for (int i = 0; i < n_in; i++) {
+      acc += (double)row[i]*bd[i];
+      row[i] *= gd[i]*s;
+    }
+    cd[j] = (cd[j] + (float)acc)*s;
 
-  const int n_embd  = hparams.n_embd;
-  const int n_layer = hparams.n_layer;
-  const int n_ctx   = hparams.n_ctx;
-  const int n_head  = hparams.n_head;
-  const int n_vocab = hparams.n_vocab;
+    if (w->type == GGML_TYPE_F16)
+      ggml_fp32_to_fp16_row(row, (ggml_fp16_t *)wrow, n_in);
+    else
+      memcpy(wrow, row, n_in * sizeof(float));
+  }
 
-  static size_t buf_size = 256u*1024*1024;
-  static void * buf = NULL;
+  free(row);
+}
 
-  if (!buf)
-    {
-      buf = malloc(buf_size);
-      memset(buf, 0, buf_size);
-    }
+/*
+  Load-time optimization: fold the constant linear transforms in front
+  of the attention and MLP input projections into their weights.
 
-  if ((*mem_per_token) > 0 && (*mem_per_token)*N > buf_size)
-    {
-      const size_t buf_size_new = 1.1*((*mem_per_token)*N); // add 10% to account for ggml object overhead
-      buf_size = buf_size_new;
-      buf = realloc(buf, buf_size);
-      if (buf == NULL) {
-	fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, buf_size);
-	return false;
-      }
-    }
+   - ln_1_g/ln_1_b into c_attn_attn_w/c_attn_attn_b,
+   - ln_2_g/ln_2_b into c_mlp_fc_w/c_mlp_fc_b,
+   - 1/sqrt(n_embd/n_head) into the Q rows of c_attn_attn_w/b.
 
-  struct ggml_init_params params = {
-    .mem_size = buf_size,
-    .mem_buffer = buf,
-    .no_alloc = false,
-  };
+  Only F32 and F16 weights can be folded. After folding, the layer
+  norm parameters are cleared and gpt2_build emits the bare norms and
+  an unscaled KQ.
+*/
+bool gpt2_model_fold(struct gpt2_model *model)
+{
+  const struct gpt2_hparams *hparams = &model->hparams;
+  const int n_embd = hparams->n_embd;
+  const float kq_scale = 1.0f/sqrt((float)n_embd/hparams->n_head);
 
-  struct ggml_context * ctx0 = ggml_init(params);
-  struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+  if (model->folded)
+    return true;
 
-  struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-  memcpy(embd->data, embd_inp, N * sizeof(*embd_inp));
+  for (int il = 0; il < hparams->n_layer; il++) {
+    const struct gpt2_layer *layer = model->layers + il;
 
-  struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-  for (int i = 0; i < N; ++i) {
-    ((int32_t *) position->data)[i] = n_past + i;
+    if ((layer->c_attn_attn_w->type != GGML_TYPE_F32 && layer->c_attn_attn_w->type != GGML_TYPE_F16)
+	|| (layer->c_mlp_fc_w->type != GGML_TYPE_F32 && layer->c_mlp_fc_w->type != GGML_TYPE_F16))
+      {
+	fprintf(stderr, "%s: cannot fold %s weights\n", __func__,
+		ggml_type_name(layer->c_attn_attn_w->type));
+	return false;
+      }
   }
 
-  // wte + wpe
-  struct ggml_tensor * inpL =
-    ggml_add(ctx0,
-	     ggml_get_rows(ctx0, model->wte, embd),
-	     ggml_get_rows(ctx0, model->wpe, position));
+  for (int il = 0; il < hparams->n_layer; il++) {
+    struct gpt2_layer *layer = model->layers + il;
 
-  for (int il = 0; il < n_layer; ++il) {
-    struct ggml_tensor * cur;
+    gpt2_fold_affine(layer->c_attn_attn_w, layer->c_attn_attn_b,
+		     layer->ln_1_g, layer->ln_1_b, n_embd, kq_scale);
+    gpt2_fold_affine(layer->c_mlp_fc_w, layer->c_mlp_fc_b,
+		     layer->ln_2_g, layer->ln_2_b, 0, 1.0f);
 
-    // norm
-    {
-      // [ 768, N]
-      cur = ggml_norm(ctx0, inpL, hparams.eps);
+    layer->ln_1_g = NULL;
+    layer->ln_1_b = NULL;
+    layer->ln_2_g = NULL;
+    layer->ln_2_b = NULL;
+  }
 
-      // cur = ln_1_g*cur + ln_1_b
-      // [ 768, N]
-      cur = ggml_add(ctx0,
-		     ggml_mul(ctx0,
-			      ggml_repeat(ctx0, model->layers[il].ln_1_g, cur),
-			      cur),
-		     ggml_repeat(ctx0, model->layers[il].ln_1_b, cur));
-    }
+  model->folded = true;
+  printf("%s: folded %d layers\n", __func__, hparams->n_layer);
+  return true;
+}
 
-    // attn
-    // [2304, 768] - model.layers[il].c_attn_attn_w
-    // [2304,   1] - model.layers[il].c_attn_attn_b
-    // [ 768,   N] - cur (in)
-    // [2304,   N] - cur (out)
-    //
-    // cur = attn_w*cur + attn_b
-    // [2304, N]
-    {
-      cur = ggml_mul_mat(ctx0,
-			 model->layers[il].c_attn_attn_w,
-			 cur);
 
-      cur = ggml_add(ctx0,
-		     ggml_repeat(ctx0, model->layers[il].c_attn_attn_b, cur),
-		     cur);
-    }
+bool gpt2_scratch_init(struct gpt2_scratch *s)
+{
+  if (s->buf)
+    return true;
+
+  s->size = ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead();
+  s->buf = malloc(s->size);
+  s->allocr = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+  s->compute_size = 0;
+  s->n_plans = 0;
+  s->work = NULL;
+  s->work_size = 0;
+  s->exec = NULL;
+  if (s->buf == NULL || s->allocr == NULL) {
+    fprintf(stderr, "%s: failed to allocate scratch\n", __func__);
+    return false;
+  }
 
-    // self-attention
-    {
-      struct ggml_tensor * Qcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 0*sizeof(float)*n_embd);
-      struct ggml_tensor * Kcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 1*sizeof(float)*n_embd);
-      struct ggml_tensor * Vcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 2*sizeof(float)*n_embd);
+  return true;
+}
 
-      // store key and value to memory
-      if (N >= 1) {
-	struct ggml_tensor * k = ggml_view_1d(ctx0, model->memory_k, N*n_embd, (ggml_element_size(model->memory_k)*n_embd)*(il*n_ctx + n_past));
-	struct ggml_tensor * v = ggml_view_1d(ctx0, model->memory_v, N*n_embd, (ggml_element_size(model->memory_v)*n_embd)*(il*n_ctx + n_past));
+void gpt2_scratch_free(struct gpt2_scratch *s)
+{
+  if (s->allocr)
+    ggml_gallocr_free(s->allocr);
+  free(s->buf);
+  free(s->work);
+  gpt2_exec_free(s->exec);
+  s->buf = NULL;
+  s->allocr = NULL;
+  s->work = NULL;
+  s->work_size = 0;
+  s->exec = NULL;
+  s->n_plans = 0;
+}
 
-	ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-	ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
-      }
+/*
+  Set up 'model' for gpt2_model_load(): default hyperparameters and the
+  evaluation settings of 'params'. Every model is set up here, so that
+  a setting added later reaches the draft model too.
+*/
+bool gpt2_model_init(struct gpt2_model *model, const struct gpt_params *params)
+{
+  memset(model, 0, sizeof(*model));
 
-      // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
-      // [64, N, 12]
-      struct ggml_tensor * Q =
-	ggml_permute(ctx0,
-		     ggml_cpy(ctx0,
-			      Qcur,
-			      ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
-		     0, 2, 1, 3);
+  // Default values.
+  model->hparams.n_vocab = 50257;
+  model->hparams.n_ctx = 1024;
+  model->hparams.n_embd = 768;
+  model->hparams.n_head = 12;
+  model->hparams.n_layer = 12;
+  model->hparams.ftype = 1;
+  model->hparams.eps = 1e-5f;
+  model->flash_attn = params->flash_attn;
+  model->v_trans = params->v_trans;
+  model->gemv = params->gemv;
+  model->shards = NULL;
+  model->gemm_n = params->gemm_n;
+  model->exec_window = params->exec_window;
+
+  model->scratch = calloc(1, sizeof(*model->scratch));
+  if (model->scratch == NULL) {
+    fprintf(stderr, "%s: failed to allocate scratch\n", __func__);
+    return false;
+  }
+  return true;
+}
 
-      // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
-      // [64, n_past + N, 12]
-      struct ggml_tensor * K =
+void gpt2_model_free(struct gpt2_model *model)
+{
+  gpt2_kv_free(&model->kv);
+  gpt2_shards_free(model->shards);
+  model->shards = NULL;
+  if (model->scratch) {
+    gpt2_scratch_free(model->scratch);
+    free(model->scratch);
+    model->scratch = NULL;
+  }
+  if (model->ctx_w)
+    ggml_free(model->ctx_w);
+  model->ctx_w = NULL;
+}
+
+/*
+  Layer norm followed by g*x + b. The parameters are broadcast along
+  the rows and applied in place on the normalized tensor, so no
+  [n_embd, N] copies of g and b are materialised. Folded parameters
+  are NULL and skipped.
+*/
+struct ggml_tensor *
+gpt2_norm(struct ggml_context *ctx,
+	  struct ggml_tensor *x,
+	  struct ggml_tensor *g,
+	  struct ggml_tensor *b,
+	  float eps)
+{
+  x = ggml_norm(ctx, x, eps);
+  if (g)
+    x = ggml_mul_inplace(ctx, x, g);
+  if (b)
+    x = ggml_add_inplace(ctx, x, b);
+  return x;
+}
+
+/*
+  Layer 'il' on the hidden state 'inpL' of N tokens after n_past. Key
+  and value rows are written to 'kv' through nodes added to 'gf'.
+  'KQ_mask' is NULL for plain causal attention.
+*/
+struct ggml_tensor *
+gpt2_build_layer(const struct gpt2_model *model,
+		 const struct gpt2_kv_cache *kv,
+		 struct ggml_context *ctx0,
+		 struct ggml_cgraph *gf,
+		 const int il,
+		 const int n_past,
+		 const int N,
+		 struct ggml_tensor *KQ_mask,
+		 struct ggml_tensor *inpL)
+{
+  const struct gpt2_hparams hparams = model->hparams;
+  const int n_embd = hparams.n_embd;
+  const int n_ctx  = kv->n_ctx;
+  const int n_head = hparams.n_head;
+
+  struct ggml_tensor * cur;
+
+  // norm
+  {
+    // cur = ln_1_g*norm(inpL) + ln_1_b
+    // [ 768, N]
+    cur = gpt2_norm(ctx0, inpL,
+		    model->layers[il].ln_1_g,
+		    model->layers[il].ln_1_b,
+		    hparams.eps);
+  }
+
+  // attn
+  // [2304, 768] - model.layers[il].c_attn_attn_w
+  // [2304,   1] - model.layers[il].c_attn_attn_b
+  // [ 768,   N] - cur (in)
+  // [2304,   N] - cur (out)
+  //
+  // cur = attn_w*cur + attn_b
+  // [2304, N]
+  {
+    cur = gpt2_mul_mat(ctx0,
+		       model->layers[il].c_attn_attn_w,
+		       cur, model->gemv, model->shards, model->gemm_n);
+
+    cur = ggml_add_inplace(ctx0, cur, model->layers[il].c_attn_attn_b);
+  }
+
+  // self-attention
+  {
+    struct ggml_tensor * Qcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 0*sizeof(float)*n_embd);
+    struct ggml_tensor * Kcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 1*sizeof(float)*n_embd);
+    struct ggml_tensor * Vcur = ggml_view_2d(ctx0, cur, n_embd, N, cur->nb[1], 2*sizeof(float)*n_embd);
+
+    // store key and value to memory
+    if (N >= 1) {
+      struct ggml_tensor * k = ggml_view_1d(ctx0, kv->k, N*n_embd, (ggml_element_size(kv->k)*n_embd)*(il*n_ctx + n_past));
+      ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
+
+      if (kv->v_trans) {
+	// transpose at write time: token n_past + i of dimension d
+	// goes to v[d][n_past + i] of this layer
+	// [N, 768]
+	const size_t esize = ggml_element_size(kv->v);
+	struct ggml_tensor * v = ggml_view_2d(ctx0, kv->v, N, n_embd,
+					      n_ctx*esize, esize*(il*n_ctx*n_embd + n_past));
+
+	ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_transpose(ctx0, Vcur), v));
+      } else {
+	struct ggml_tensor * v = ggml_view_1d(ctx0, kv->v, N*n_embd, (ggml_element_size(kv->v)*n_embd)*(il*n_ctx + n_past));
+
+	ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+      }
+    }
+
+    if (model->flash_attn) {
+      const int n_kv = n_past + N;
+      const size_t esize = ggml_element_size(kv->k);
+
+      // Q = Qcur.view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3), no copy
+      // [64, N, 12]
+      struct ggml_tensor * Q =
+	ggml_permute(ctx0,
+		     ggml_view_3d(ctx0, cur, n_embd/n_head, n_head, N,
+				  ggml_element_size(cur)*n_embd/n_head, cur->nb[1], 0),
+		     0, 2, 1, 3);
+
+      // K and V are read in place from memory
+      // [64, n_past + N, 12]
+      struct ggml_tensor * K =
+	ggml_view_3d(ctx0, kv->k, n_embd/n_head, n_kv, n_head,
+		     esize*n_embd, esize*n_embd/n_head, esize*n_embd*il*n_ctx);
+      struct ggml_tensor * V =
+	ggml_view_3d(ctx0, kv->v, n_embd/n_head, n_kv, n_head,
+		     esize*n_embd, esize*n_embd/n_head, esize*n_embd*il*n_ctx);
+
+      // KQV = soft_max(K*Q*scale + mask)*V, one query row at a time with
+      // an online soft max, so no [n_past + N, N, 12] tensor is built
+      // [64, 12, N]
+      struct ggml_tensor * KQV =
+	ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask,
+			    model->folded ? 1.0f : 1.0f/sqrt((float)n_embd/n_head), 0.0f);
+
+      // [768, N]
+      cur = ggml_reshape_2d(ctx0, KQV, n_embd, N);
+    } else {
+      // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
+      // [64, N, 12]
+      struct ggml_tensor * Q =
+	ggml_permute(ctx0,
+		     ggml_cpy(ctx0,
+			      Qcur,
+			      ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd/n_head, n_head, N)),
+		     0, 2, 1, 3);
+
+      // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
+      // [64, n_past + N, 12]
+      struct ggml_tensor * K =
 	ggml_permute(ctx0,
 		     ggml_reshape_3d(ctx0,
-				     ggml_view_1d(ctx0, model->memory_k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model->memory_k)*n_embd),
+				     ggml_view_1d(ctx0, kv->k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(kv->k)*n_embd),
 				     n_embd/n_head, n_head, n_past + N),
 		     0, 2, 1, 3);
 
@@ -541,29 +1292,47 @@ bool gpt2_eval(const struct gpt2_model *model,
       // K * Q
       // [n_past + N, N, 12]
       struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-      // KQ_scaled = KQ / sqrt(n_embd/n_head)
-      // [n_past + N, N, 12]
-      struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, 1.0f/sqrt((float)n_embd/n_head));
-
-      // KQ_masked = mask_past(KQ_scaled)
-      // [n_past + N, N, 12]
-      struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
-
-      // KQ = soft_max(KQ_masked)
-      // [n_past + N, N, 12]
-      struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+      struct ggml_tensor * KQ_soft_max;
+
+      if (KQ_mask) {
+	// KQ = soft_max(KQ*scale + mask)
+	// [n_past + N, N, 12]
+	KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask,
+					model->folded ? 1.0f : 1.0f/sqrt((float)n_embd/n_head), 0.0f);
+      } else {
+	// KQ_scaled = KQ / sqrt(n_embd/n_head)
+	// [n_past + N, N, 12]
+	struct ggml_tensor * KQ_scaled = model->folded ? KQ :
+	  ggml_scale_inplace(ctx0, KQ, 1.0f/sqrt((float)n_embd/n_head));
+
+	// KQ_masked = mask_past(KQ_scaled)
+	// [n_past + N, N, 12]
+	struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+
+	// KQ = soft_max(KQ_masked)
+	// [n_past + N, N, 12]
+	KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+      }
 
       // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
       // [n_past + N, 64, 12]
-      struct ggml_tensor * V_trans =
-	ggml_cpy(ctx0,
-		 ggml_permute(ctx0,
-			      ggml_reshape_3d(ctx0,
-					      ggml_view_1d(ctx0, model->memory_v, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model->memory_v)*n_embd),
-					      n_embd/n_head, n_head, n_past + N),
-			      1, 2, 0, 3),
-		 ggml_new_tensor_3d(ctx0, model->memory_v->type, n_past + N, n_embd/n_head, n_head));
+      struct ggml_tensor * V_trans;
+      if (kv->v_trans) {
+	// already in this layout in memory, just view it
+	const size_t esize = ggml_element_size(kv->v);
+
+	V_trans = ggml_view_3d(ctx0, kv->v, n_past + N, n_embd/n_head, n_head,
+			       n_ctx*esize, n_ctx*esize*n_embd/n_head, esize*il*n_ctx*n_embd);
+      } else {
+	V_trans =
+	  ggml_cpy(ctx0,
+		   ggml_permute(ctx0,
+				ggml_reshape_3d(ctx0,
+						ggml_view_1d(ctx0, kv->v, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(kv->v)*n_embd),
+						n_embd/n_head, n_head, n_past + N),
+				1, 2, 0, 3),
+		   ggml_new_tensor_3d(ctx0, kv->v->type, n_past + N, n_embd/n_head, n_head));
+      }
 
       // KQV = transpose(V) * KQ_soft_max
       // [64, N, 12]
@@ -579,134 +1348,699 @@ bool gpt2_eval(const struct gpt2_model *model,
 		     KQV_merged,
 		     ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
     }
+  }
 
-    // projection
-    // [ 768, 768] - model.layers[il].c_attn_proj_w
-    // [ 768,   1] - model.layers[il].c_attn_proj_b
+  // projection
+  // [ 768, 768] - model.layers[il].c_attn_proj_w
+  // [ 768,   1] - model.layers[il].c_attn_proj_b
+  // [ 768,   N] - cur (in)
+  // [ 768,   N] - cur (out)
+  //
+  // cur = proj_w*cur + proj_b
+  // [768, N]
+  {
+    cur = gpt2_mul_mat(ctx0,
+		       model->layers[il].c_attn_proj_w,
+		       cur, model->gemv, model->shards, model->gemm_n);
+
+    cur = ggml_add_inplace(ctx0, cur, model->layers[il].c_attn_proj_b);
+
+
+  }
+
+  // add the input
+  cur = ggml_add(ctx0, cur, inpL);
+
+  struct ggml_tensor * inpFF = cur;
+
+  // feed-forward network
+  {
+    // norm
+    {
+      // cur = ln_2_g*norm(inpFF) + ln_2_b
+      // [ 768, N]
+      cur = gpt2_norm(ctx0, inpFF,
+		      model->layers[il].ln_2_g,
+		      model->layers[il].ln_2_b,
+		      hparams.eps);
+    }
+
+    // fully connected
+    // [3072, 768] - model.layers[il].c_mlp_fc_w
+    // [3072,   1] - model.layers[il].c_mlp_fc_b
     // [ 768,   N] - cur (in)
-    // [ 768,   N] - cur (out)
+    // [3072,   N] - cur (out)
+    //
+    // cur = fc_w*cur + fc_b
+    // [3072, N]
+    cur = gpt2_mul_mat(ctx0,
+		       model->layers[il].c_mlp_fc_w,
+		       cur, model->gemv, model->shards, model->gemm_n);
+
+    cur = ggml_add_inplace(ctx0, cur, model->layers[il].c_mlp_fc_b);
+
+    // GELU activation
+    // [3072, N]
+    cur = ggml_gelu(ctx0, cur);
+
+    // projection
+    // [ 768, 3072] - model.layers[il].c_mlp_proj_w
+    // [ 768,    1] - model.layers[il].c_mlp_proj_b
+    // [3072,    N] - cur (in)
+    // [ 768,    N] - cur (out)
     //
     // cur = proj_w*cur + proj_b
     // [768, N]
-    {
-      cur = ggml_mul_mat(ctx0,
-			 model->layers[il].c_attn_proj_w,
-			 cur);
+    cur = gpt2_mul_mat(ctx0,
+		       model->layers[il].c_mlp_proj_w,
+		       cur, model->gemv, model->shards, model->gemm_n);
 
-      cur = ggml_add(ctx0,
-		     ggml_repeat(ctx0, model->layers[il].c_attn_proj_b, cur),
-		     cur);
+    cur = ggml_add_inplace(ctx0, cur, model->layers[il].c_mlp_proj_b);
+  }
 
+  // input for next layer
+  return ggml_add(ctx0, cur, inpFF);
+}
 
-    }
+/*
+  Construct the evaluation graph in 'ctx0', a no_alloc context: only
+  shapes are known after this, tensor data is placed later.
+*/
+static void gpt2_build_graph(const struct gpt2_model *model,
+			     const struct gpt2_kv_cache *kv,
+			     struct ggml_context *ctx0,
+			     const int n_past,
+			     const int N,
+			     enum gpt2_logits logits,
+			     const int n_seq,
+			     bool masked,
+			     struct gpt2_graph *g)
+{
+  const bool embd_mode = logits == GPT2_EMBD_LAST || logits == GPT2_EMBD_MEAN;
+  const int n_out = logits == GPT2_LOGITS_ALL ? N : embd_mode ? n_seq : 1;
+  // the last row of a single sequence needs no pooling
+  const bool pooled = embd_mode && !(logits == GPT2_EMBD_LAST && n_seq == 1);
+  struct gpt2_hparams hparams = model->hparams;
 
-    // add the input
-    cur = ggml_add(ctx0, cur, inpL);
+  const int n_embd  = hparams.n_embd;
+  const int n_layer = hparams.n_layer;
 
-    struct ggml_tensor * inpFF = cur;
+  struct ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-    // feed-forward network
-    {
-      // norm
-      {
-	cur = ggml_norm(ctx0, inpFF, hparams.eps);
-
-	// cur = ln_2_g*cur + ln_2_b
-	// [ 768, N]
-	cur = ggml_add(ctx0,
-		       ggml_mul(ctx0,
-				ggml_repeat(ctx0, model->layers[il].ln_2_g, cur),
-				cur),
-		       ggml_repeat(ctx0, model->layers[il].ln_2_b, cur));
-      }
+  struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+  ggml_set_input(embd);
 
-      // fully connected
-      // [3072, 768] - model.layers[il].c_mlp_fc_w
-      // [3072,   1] - model.layers[il].c_mlp_fc_b
-      // [ 768,   N] - cur (in)
-      // [3072,   N] - cur (out)
-      //
-      // cur = fc_w*cur + fc_b
-      // [3072, N]
-      cur = ggml_mul_mat(ctx0,
-			 model->layers[il].c_mlp_fc_w,
-			 cur);
-
-      cur = ggml_add(ctx0,
-		     ggml_repeat(ctx0, model->layers[il].c_mlp_fc_b, cur),
-		     cur);
-
-      // GELU activation
-      // [3072, N]
-      cur = ggml_gelu(ctx0, cur);
-
-      // projection
-      // [ 768, 3072] - model.layers[il].c_mlp_proj_w
-      // [ 768,    1] - model.layers[il].c_mlp_proj_b
-      // [3072,    N] - cur (in)
-      // [ 768,    N] - cur (out)
-      //
-      // cur = proj_w*cur + proj_b
-      // [768, N]
-      cur = ggml_mul_mat(ctx0,
-			 model->layers[il].c_mlp_proj_w,
-			 cur);
+  struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+  ggml_set_input(position);
+
+  // causal mask for the fused attention, rows padded as ggml requires
+  // [n_past + N, PAD(N)]
+  // or, if 'masked', the mask of a batch layout for the plain attention
+  // [n_past + N, N]
+  struct ggml_tensor * KQ_mask = NULL;
+  if (model->flash_attn) {
+    KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, n_past + N, GGML_PAD(N, GGML_KQ_MASK_PAD));
+    ggml_set_input(KQ_mask);
+  } else if (masked) {
+    KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_past + N, N);
+    ggml_set_input(KQ_mask);
+  }
 
-      cur = ggml_add(ctx0,
-		     ggml_repeat(ctx0, model->layers[il].c_mlp_proj_b, cur),
-		     cur);
-    }
+  // wte + wpe
+  struct ggml_tensor * inpL =
+    ggml_add(ctx0,
+	     ggml_get_rows(ctx0, model->wte, embd),
+	     ggml_get_rows(ctx0, model->wpe, position));
 
-    // input for next layer
-    inpL = ggml_add(ctx0, cur, inpFF);
-  }
+  for (int il = 0; il < n_layer; ++il)
+    inpL = gpt2_build_layer(model, kv, ctx0, gf, il, n_past, N, KQ_mask, inpL);
+
+  // the final norm and lm_head are row-wise: only keep the rows we
+  // need logits for, lm_head is the largest matmul in the model
+  // [ 768, n_out]
+  if (!pooled && n_out < N)
+    inpL = ggml_view_2d(ctx0, inpL, n_embd, n_out, inpL->nb[1], (N - n_out)*inpL->nb[1]);
 
   // norm
   {
-    // [ 768, N]
-    inpL = ggml_norm(ctx0, inpL, hparams.eps);
-
-    // inpL = ln_f_g*inpL + ln_f_b
-    // [ 768, N]
-    inpL = ggml_add(ctx0,
-		    ggml_mul(ctx0,
-			     ggml_repeat(ctx0, model->ln_f_g, inpL),
-			     inpL),
-		    ggml_repeat(ctx0, model->ln_f_b, inpL));
+    // inpL = ln_f_g*norm(inpL) + ln_f_b
+    // [ 768, n_out]
+    inpL = gpt2_norm(ctx0, inpL, model->ln_f_g, model->ln_f_b, hparams.eps);
   }
 
-  // inpL = WTE * inpL
-  // [ 768, 50257] - model.lm_head
-  // [ 768, N]     - inpL
-  inpL = ggml_mul_mat(ctx0, model->lm_head, inpL);
+  struct ggml_tensor * pool = NULL;
+  if (pooled) {
+    // inpL = inpL * pool, pool holds the weight of each row in the
+    // embedding of its sequence: 1/len for the mean, 1 for the last
+    // [    N, n_seq] - pool
+    // [  768, n_seq] - inpL (out)
+    pool = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, N, n_seq);
+    ggml_set_input(pool);
+
+    inpL = ggml_mul_mat(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, inpL)), pool);
+  } else if (!embd_mode) {
+    // inpL = WTE * inpL
+    // [ 768, 50257] - model.lm_head
+    // [ 768, n_out] - inpL
+    inpL = gpt2_mul_mat(ctx0, model->lm_head, inpL, model->gemv, model->shards,
+			model->gemm_n);
+  }
 
   // logits -> probs
   //  inpL = ggml_soft_max_inplace(ctx0, inpL);
 
-  // run the computation
+  ggml_set_output(inpL);
   ggml_build_forward_expand(gf, inpL);
-  ggml_graph_compute_with_ctx(ctx0, gf, n_threads);
+
+  g->ctx = ctx0;
+  g->gf = gf;
+  g->embd = embd;
+  g->position = position;
+  g->kq_mask = KQ_mask;
+  g->pool = pool;
+  g->logits = inpL;
+  g->mode = logits;
+  g->n_past = n_past;
+  g->N = N;
+  g->n_out = n_out;
+}
+
+/*
+  Build a graph for N tokens after the first n_past rows of 'kv', and
+  allocate it in 's'. Token i is at position n_past + i and sees the
+  rows up to its own, unless a batch layout 'bl' says otherwise.
+*/
+bool gpt2_build_batch(const struct gpt2_model *model,
+		      const struct gpt2_kv_cache *kv,
+		      struct gpt2_scratch *s,
+		      const int n_past,
+		      const int N,
+		      enum gpt2_logits logits,
+		      const struct gpt2_batch_layout *bl,
+		      struct gpt2_graph *g)
+{
+  const int64_t t_start_us = ggml_time_us();
+
+  /* Tensor data is placed by s->allocr once the graph is complete. */
+  struct ggml_init_params params = {
+    .mem_size = s->size,
+    .mem_buffer = s->buf,
+    .no_alloc = true,
+  };
+
+  struct ggml_context * ctx0 = ggml_init(params);
+  if (!ctx0) {
+    fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+    return false;
+  }
+
+  gpt2_build_graph(model, kv, ctx0, n_past, N, logits, bl ? bl->n_seq : 1, bl != NULL, g);
+  g->s = s;
+  g->kv = kv;
+
+  if (!ggml_gallocr_alloc_graph(s->allocr, g->gf)) {
+    fprintf(stderr, "%s: failed to allocate the compute buffer\n", __func__);
+    ggml_free(ctx0);
+    return false;
+  }
+
+  if (ggml_gallocr_get_buffer_size(s->allocr, 0) > s->compute_size) {
+    s->compute_size = ggml_gallocr_get_buffer_size(s->allocr, 0);
+    printf("%s: compute buffer = %8.2f MB (N = %d, n_past = %d)\n", __func__,
+	   s->compute_size/1024.0/1024.0, N, n_past);
+  }
+
+  for (int i = 0; i < N; ++i) {
+    ((int32_t *) g->position->data)[i] = bl ? bl->pos[i] : n_past + i;
+  }
+
+  if (g->kq_mask) {
+    const int n_kv = n_past + N;
+
+    for (int i = 0; i < g->kq_mask->ne[1]; i++) {
+      char *row = (char *)g->kq_mask->data + i*g->kq_mask->nb[1];
+
+      for (int j = 0; j < n_kv; j++) {
+	bool visible;
+
+	if (i >= N)
+	  visible = false;
+	else if (bl)
+	  visible = j < n_past ? !bl->cell_seq || (bl->cell_seq[j] >> bl->seq[i]) & 1
+	    : j - n_past <= i && bl->seq[j - n_past] == bl->seq[i];
+	else
+	  visible = j <= n_past + i;
+
+	if (g->kq_mask->type == GGML_TYPE_F16)
+	  ((ggml_fp16_t *)row)[j] = ggml_fp32_to_fp16(visible ? 0.0f : -INFINITY);
+	else
+	  ((float *)row)[j] = visible ? 0.0f : -INFINITY;
+      }
+    }
+  }
+
+  if (g->pool) {
+    float *pool = (float *)g->pool->data;
+    int *len = calloc(g->n_out, sizeof(int));
+    int *last = calloc(g->n_out, sizeof(int));
+
+    for (int i = 0; i < N; i++) {
+      const int sq = bl ? bl->seq[i] : 0;
+
+      len[sq]++;
+      last[sq] = i;
+    }
+
+    memset(pool, 0, ggml_nbytes(g->pool));
+    for (int i = 0; i < N; i++) {
+      const int sq = bl ? bl->seq[i] : 0;
+
+      if (logits == GPT2_EMBD_MEAN)
+	pool[sq*N + i] = 1.0f/len[sq];
+      else if (i == last[sq])
+	pool[sq*N + i] = 1.0f;
+    }
+
+    free(len);
+    free(last);
+  }
+
+  nuxmeasure_add(&gpt2_build_us, ggml_time_us() - t_start_us);
+  return true;
+}
+
+bool gpt2_build(const struct gpt2_model *model,
+		const struct gpt2_kv_cache *kv,
+		struct gpt2_scratch *s,
+		const int n_past,
+		const int N,
+		enum gpt2_logits logits,
+		struct gpt2_graph *g)
+{
+  return gpt2_build_batch(model, kv, s, n_past, N, logits, NULL, g);
+}
+
+/*
+  Grow the work buffer of 's' to 'size' bytes.
+*/
+bool
+gpt2_scratch_work(struct gpt2_scratch *s, const size_t size)
+{
+  void *work;
+
+  if (size <= s->work_size)
+    return true;
+
+  free(s->work);
+  s->work = NULL;
+  s->work_size = 0;
+  if (posix_memalign(&work, 64, size) || work == NULL) {
+    fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, size);
+    return false;
+  }
+  s->work = work;
+  s->work_size = size;
+  return true;
+}
+
+static bool
+gpt2_plan_match(const struct gpt2_plan *plan, const struct gpt2_model *model)
+{
+  return plan->model == model && plan->folded == model->folded
+    && plan->flash_attn == model->flash_attn && plan->v_trans == model->v_trans
+    && plan->gemv == model->gemv && plan->shards == model->shards
+    && plan->gemm_n == model->gemm_n;
+}
+
+/*
+  The cached plan of a graph of N tokens of 'model' with logits for
+  n_out of them over 'kv', or NULL.
+*/
+struct ggml_cplan *
+gpt2_plan_find(struct gpt2_scratch *s, const struct gpt2_model *model,
+	       const struct gpt2_kv_cache *kv, const int N, enum gpt2_logits mode,
+	       const int n_out, const bool masked, const int n_threads)
+{
+  for (int i = 0; i < s->n_plans; i++) {
+    struct gpt2_plan *plan = s->plans + i;
+
+    if (gpt2_plan_match(plan, model) && plan->N == N && plan->mode == mode && plan->n_out == n_out
+	&& plan->n_ctx == kv->n_ctx_max && plan->masked == masked && plan->cplan.n_threads == n_threads)
+      return &plan->cplan;
+  }
+  return NULL;
+}
+
+/*
+  Plan 'gf', the graph with the largest n_past of its shape, cache the
+  plan under the key of gpt2_plan_find() and make sure the work buffer
+  can hold it.
+*/
+struct ggml_cplan *
+gpt2_plan_add(struct gpt2_scratch *s, const struct gpt2_model *model,
+	      const struct gpt2_kv_cache *kv, const int N, enum gpt2_logits mode,
+	      const int n_out, const bool masked, struct ggml_cgraph *gf, const int n_threads)
+{
+  struct gpt2_plan *plan;
+
+  if (s->n_plans < GPT2_MAX_PLANS)
+    plan = s->plans + s->n_plans++;
+  else
+    plan = s->plans + (N % GPT2_MAX_PLANS);
+  plan->model = model;
+  plan->folded = model->folded;
+  plan->flash_attn = model->flash_attn;
+  plan->v_trans = model->v_trans;
+  plan->gemv = model->gemv;
+  plan->shards = model->shards;
+  plan->gemm_n = model->gemm_n;
+  plan->N = N;
+  plan->mode = mode;
+  plan->n_out = n_out;
+  plan->n_ctx = kv->n_ctx_max;
+  plan->masked = masked;
+  plan->cplan = gpt2_ggml_graph_plan(gf, n_threads);
+
+  if (!gpt2_scratch_work(s, plan->cplan.work_size)) {
+    plan->N = 0;
+    return NULL;
+  }
+  return &plan->cplan;
+}
+
+/*
+  A context for a graph to plan, separate from s->buf, which holds the
+  graph being computed, and in 'wkv' a view of 'kv' at n_ctx_max rows.
+  The memory may not have grown to n_ctx_max yet: the view is never
+  allocated. Free the context with gpt2_plan_ctx_free().
+*/
+struct ggml_context *
+gpt2_plan_ctx(const struct gpt2_scratch *s, const struct gpt2_kv_cache *kv,
+	      struct gpt2_kv_cache *wkv)
+{
+  void *meta = malloc(s->size);
+  struct ggml_init_params params = {
+    .mem_size = s->size,
+    .mem_buffer = meta,
+    .no_alloc = true,
+  };
+  struct ggml_context *ctx = meta ? ggml_init(params) : NULL;
+
+  if (ctx == NULL) {
+    free(meta);
+    return NULL;
+  }
+
+  *wkv = *kv;
+  wkv->n_ctx = kv->n_ctx_max;
+  wkv->k = ggml_new_tensor_1d(ctx, kv->type, (int64_t)kv->n_embd*kv->n_layer*kv->n_ctx_max);
+  wkv->v = ggml_new_tensor_1d(ctx, kv->type, (int64_t)kv->n_embd*kv->n_layer*kv->n_ctx_max);
+  return ctx;
+}
+
+void
+gpt2_plan_ctx_free(struct ggml_context *ctx)
+{
+  void *meta = ggml_get_mem_buffer(ctx);
+
+  ggml_free(ctx);
+  free(meta);
+}
+
+/*
+  Return the compute plan for graphs of N tokens of 'model' with logits
+  for n_out of them over 'kv', and make sure the scratch work buffer
+  can hold it.
+
+  The work size of a graph grows with n_past (soft max rows, the KQV
+  product) and nothing else changes between two steps of the same
+  shape, so the plan is computed once on the graph with the largest
+  n_past, built without allocating it, and reused by every step.
+*/
+struct ggml_cplan *
+gpt2_plan(const struct gpt2_model *model, const struct gpt2_kv_cache *kv,
+	  struct gpt2_scratch *s,
+	  const int N, enum gpt2_logits mode, const int n_out, const bool masked,
+	  const int n_threads)
+{
+  const int n_past_max = kv->n_ctx_max > N ? kv->n_ctx_max - N : 0;
+  struct ggml_cplan *cplan;
+  struct gpt2_kv_cache wkv;
+  struct ggml_context *ctx;
+  struct gpt2_graph wg;
+
+  cplan = gpt2_plan_find(s, model, kv, N, mode, n_out, masked, n_threads);
+  if (cplan != NULL)
+    return cplan;
+
+  nuxperf_inc(&gpt2_plan_miss);
+
+  ctx = gpt2_plan_ctx(s, kv, &wkv);
+  if (ctx == NULL)
+    return NULL;
+  gpt2_build_graph(model, &wkv, ctx, n_past_max, N, mode, n_out, masked, &wg);
+  cplan = gpt2_plan_add(s, model, kv, N, mode, n_out, masked, wg.gf, n_threads);
+  gpt2_plan_ctx_free(ctx);
+  return cplan;
+}
+
+bool gpt2_compute(const struct gpt2_model *model, struct gpt2_graph *g, const int n_threads)
+{
+  const int64_t t_start_us = ggml_time_us();
+  struct ggml_cplan *cplan;
+
+  if (model->exec_window > 0 && g->N == 1) {
+    if (g->s->exec == NULL)
+      g->s->exec = gpt2_exec_new();
+    if (g->s->exec == NULL
+	|| !gpt2_exec_compute(g->s->exec, g->gf, n_threads, model->exec_window))
+      return false;
+    nuxmeasure_add(&gpt2_compute_us, ggml_time_us() - t_start_us);
+    return true;
+  }
+
+  cplan = gpt2_plan(model, g->kv, g->s, g->N, g->mode, g->n_out,
+		    g->kq_mask != NULL, n_threads);
+  if (cplan == NULL)
+    return false;
+
+  GGML_ASSERT(cplan->work_size <= g->s->work_size);
+  cplan->work_data = g->s->work;
+  gpt2_ggml_graph_compute(g->gf, cplan);
+  nuxmeasure_add(&gpt2_compute_us, ggml_time_us() - t_start_us);
 
   //if (n_past%100 == 0) {
   //  ggml_graph_print   (gf);
   //  ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
   //}
+  return true;
+}
 
-  //    embd_w.resize(n_vocab*N);
-  //    memcpy(embd_w._data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+void gpt2_graph_free(struct gpt2_graph *g)
+{
+  ggml_free(g->ctx);
+  g->ctx = NULL;
+}
 
-  // return result just for the last token
-  fvec_copy_array(embd_w, (float *)ggml_get_data(inpL)+(n_vocab*(N-1)), n_vocab);
+bool gpt2_eval(const struct gpt2_model *model,
+	       struct gpt2_kv_cache *kv,
+	       const int n_threads,
+	       const int n_past,
+	       int32_t *embd_inp,
+	       int embd_inp_count,
+	       enum gpt2_logits logits,
+	       struct fvec *embd_w,
+	       size_t *mem_per_token)
+{
+  const int N = embd_inp_count;
+
+  struct gpt2_graph g;
+
+  if (!gpt2_scratch_init(model->scratch) || !gpt2_kv_reserve(kv, n_past, n_past + N))
+    return false;
+
+  if (!gpt2_build(model, kv, model->scratch, n_past, N, logits, &g))
+    return false;
+
+  memcpy(g.embd->data, embd_inp, N * sizeof(*embd_inp));
+
+  // run the computation
+  if (!gpt2_compute(model, &g, n_threads)) {
+    gpt2_graph_free(&g);
+    return false;
+  }
+
+  // return the logits of the last n_out tokens, or the embedding
+  fvec_copy_array(embd_w, (float *)ggml_get_data(g.logits), ggml_nelements(g.logits));
 
   if (*mem_per_token == 0) {
-    *mem_per_token = ggml_used_mem(ctx0)/N;
+    *mem_per_token = model->scratch->compute_size/N;
   }
-  ggml_free(ctx0);
+  gpt2_graph_free(&g);
 
   return true;
 }
 
-#include <nux/nux.h>
+/*
+  Fold the model and check that the folded graph computes the same
+  logits as the unfolded one on a fixed batch. F16 weights are rounded
+  again after folding, hence the relative tolerance.
+*/
+bool gpt2_model_fold_check(struct gpt2_model *model, const int n_threads)
+{
+  int32_t tokens[8] = { 464, 2068, 7586, 21831, 18045, 625, 262, 16931 };
+  const int n_vocab = model->hparams.n_vocab;
+  struct fvec ref, out;
+  size_t mem_per_token = 0;
+  float max_abs = 0.0f, max_diff = 0.0f;
+  int ref_max = 0, out_max = 0;
+  bool ok;
+
+  fvec_init(&ref);
+  fvec_init(&out);
+
+  if (!gpt2_eval(model, &model->kv, n_threads, 0, tokens, 8, GPT2_LOGITS_LAST, &ref, &mem_per_token)
+      || !gpt2_model_fold(model)
+      || !gpt2_eval(model, &model->kv, n_threads, 0, tokens, 8, GPT2_LOGITS_LAST, &out, &mem_per_token))
+    {
+      fvec_free(&ref);
+      fvec_free(&out);
+      return false;
+    }
+
+  for (int i = 0; i < n_vocab; i++) {
+    const float r = fvec_data(&ref)[i];
+    const float o = fvec_data(&out)[i];
+
+    max_abs = fmax(max_abs, fabs(r));
+    max_diff = fmax(max_diff, fabs(r - o));
+    if (r > fvec_data(&ref)[ref_max])
+      ref_max = i;
+    if (o > fvec_data(&out)[out_max])
+      out_max = i;
+  }
+
+  ok = ref_max == out_max && max_diff <= 1e-2f*max_abs;
+  printf("%s: max |logit| = " PRIf ", max diff = " PRIf ", argmax %d/%d: %s\n",
+	 __func__, FLOATPRINT(max_abs), FLOATPRINT(max_diff),
+	 ref_max, out_max, ok ? "OK" : "FAILED");
+
+  fvec_free(&ref);
+  fvec_free(&out);
+  return ok;
+}
+
+/*
+  Prefill tokens per second with the weight products of ggml and of
+  BLIS, for a few batch sizes, and the largest difference between the
+  logits of the two.
+*/
+void gpt2_gemm_bench(struct gpt2_model *model, const int n_threads)
+{
+  static const int batch[] = { 8, 16, 32, 64, 128, 256 };
+  const int n_rep = 4;
+  const int n_vocab = model->hparams.n_vocab;
+  const int gemm_n = model->gemm_n;
+  int32_t tokens[256];
+  struct fvec out[2];
+  size_t mem_per_token = 0;
+
+  for (int i = 0; i < 256; i++)
+    tokens[i] = (i*7919 + 13) % n_vocab;
+
+  fvec_init(out + 0);
+  fvec_init(out + 1);
+
+  printf("%s: %5s %12s %12s %10s\n", __func__, "N", "ggml tok/s", "blis tok/s", "max diff");
+  for (size_t b = 0; b < sizeof(batch)/sizeof(batch[0]); b++) {
+    const int N = batch[b];
+    int64_t t_us[2];
+    float max_diff = 0.0f;
+
+    for (int p = 0; p < 2; p++) {
+      const int64_t t_start_us = ggml_time_us();
+
+      model->gemm_n = p ? 1 : 0;
+      for (int r = 0; r < n_rep; r++)
+	if (!gpt2_eval(model, &model->kv, n_threads, 0, tokens, N, GPT2_LOGITS_LAST,
+		       out + p, &mem_per_token)) {
+	  fprintf(stderr, "%s: failed to evaluate %d tokens\n", __func__, N);
+	  goto out;
+	}
+      t_us[p] = ggml_time_us() - t_start_us;
+    }
+
+    for (int i = 0; i < n_vocab; i++)
+      max_diff = fmax(max_diff, fabs(fvec_data(out + 0)[i] - fvec_data(out + 1)[i]));
+
+    printf("%s: %5d %12ld %12ld " PRIf "\n", __func__, N,
+	   (long)(1000000LL*N*n_rep/t_us[0]), (long)(1000000LL*N*n_rep/t_us[1]),
+	   FLOATPRINT(max_diff));
+  }
+
+ out:
+  model->gemm_n = gemm_n;
+  fvec_free(out + 0);
+  fvec_free(out + 1);
+}
+
+/*
+  Decode time per token with the ggml scheduler, with the executor
+  running the nodes in order (a barrier after every node) and with the
+  executor overlapping nodes, and the time the CPUs spent waiting.
+*/
+#define GPT2_EXEC_BENCH_WINDOW 8
+
+void gpt2_exec_bench(struct gpt2_model *model, const int n_threads)
+{
+  const int n_prompt = 8;
+  const int n_decode = 16;
+  const int n_vocab = model->hparams.n_vocab;
+  const int exec_window = model->exec_window;
+  const int window[] = { 0, 1, exec_window > 1 ? exec_window : GPT2_EXEC_BENCH_WINDOW };
+  int32_t tokens[8 + 16];
+  struct fvec out;
+  size_t mem_per_token = 0;
+
+  for (int i = 0; i < n_prompt + n_decode; i++)
+    tokens[i] = (i*7919 + 13) % n_vocab;
+
+  fvec_init(&out);
+
+  printf("%s: %6s %10s %10s\n", __func__, "window", "us/token", "wait us");
+  for (size_t w = 0; w < sizeof(window)/sizeof(window[0]); w++) {
+    int64_t t_us, t_idle_us;
+
+    model->exec_window = 0;
+    if (!gpt2_eval(model, &model->kv, n_threads, 0, tokens, n_prompt, GPT2_LOGITS_LAST,
+		   &out, &mem_per_token)) {
+      fprintf(stderr, "%s: failed to evaluate the prompt\n", __func__);
+      break;
+    }
+
+    model->exec_window = window[w];
+    t_idle_us = gpt2_exec_idle_total(model->scratch->exec);
+    t_us = ggml_time_us();
+    for (int i = 0; i < n_decode; i++)
+      if (!gpt2_eval(model, &model->kv, n_threads, n_prompt + i, tokens + n_prompt + i, 1,
+		     GPT2_LOGITS_LAST, &out, &mem_per_token)) {
+	fprintf(stderr, "%s: failed to decode at %d\n", __func__, n_prompt + i);
+	goto out;
+      }
+    t_us = ggml_time_us() - t_us;
+    t_idle_us = gpt2_exec_idle_total(model->scratch->exec) - t_idle_us;
+
+    if (window[w] == 0)
+      printf("%s: %6s %10ld %10s\n", __func__, "ggml", (long)(t_us/n_decode), "n/a");
+    else
+      printf("%s: %6d %10ld %10ld\n", __func__, window[w], (long)(t_us/n_decode),
+	     (long)(t_idle_us/n_decode));
+  }
+
+ out:
+  model->exec_window = exec_window;
+  fvec_free(&out);
+}
 
 void _gpt2_init(void *unused)
 {
@@ -720,21 +2054,30 @@ void _gpt2_init(void *unused)
   gpt_params_default(&params);
 
   params.prompt = "hello";
-  params.n_threads = cpu_num() - 1;
+  params.n_threads = nuxcompute_cpu_count();
+
+  {
+    const unsigned features = nuxcompute_cpu_features();
+
+    printf("%s: ggml kernels %s\n", __func__, gpt2_ggml_select(features));
+    printf("%s: GEMV kernels %s\n", __func__, gpt2_gemv_select(features));
+  }
 
   int64_t t_load_us = 0;
 
   struct vocab vocab;
   struct gpt2_model model;
+  struct gpt2_model draft;
+  struct vocab draft_vocab;
+  bool has_draft = false;
+  struct gpt2_tp *tp = NULL;
+  int32_t *embd_inp = NULL;
+  int32_t *embd = NULL;
+  struct fvec logits;
 
-  // Default values.
-  model.hparams.n_vocab = 50257;
-  model.hparams.n_ctx = 1024;
-  model.hparams.n_embd = 768;
-  model.hparams.n_head = 12;
-  model.hparams.n_layer = 12;
-  model.hparams.ftype = 1;
-  model.hparams.eps = 1e-5f;
+  if (!gpt2_model_init(&model, &params))
+    return;
+  fvec_init(&logits);
 
   // load the model
   {
@@ -742,23 +2085,237 @@ void _gpt2_init(void *unused)
 
     if (!gpt2_model_load((void *)0xffff828000000000L, 251222425, &model, &vocab)) {
       fprintf(stderr, "%s: failed to load model from '%s'\n", __func__, params.model);
-      return;
+      goto out;
     }
     t_load_us = ggml_time_us() - t_start_us;
   }
 
+  if (params.fold && params.fold_check) {
+    // the weights are folded in place, there is no unfolded copy left
+    if (!gpt2_model_fold_check(&model, params.n_threads)) {
+      fprintf(stderr, "%s: folded model check failed, not generating\n", __func__);
+      goto out;
+    }
+  } else if (params.fold) {
+    gpt2_model_fold(&model);
+  }
+
+  if ((params.gemm_n > 0 || params.gemm_bench)
+      && !gpt2_gemm_init(params.n_threads, 4*model.hparams.n_embd))
+    fprintf(stderr, "%s: failed to allocate the BLIS buffers, F16 products use ggml\n", __func__);
+  if (params.gemm_bench)
+    gpt2_gemm_bench(&model, params.n_threads);
+
+  if (params.gemv_bench || (params.gemv && params.shard)) {
+    const int n_w = 4*model.hparams.n_layer + 1;
+    struct ggml_tensor **w = malloc(n_w*sizeof(*w));
+
+    for (int il = 0; il < model.hparams.n_layer; il++) {
+      w[4*il + 0] = model.layers[il].c_attn_attn_w;
+      w[4*il + 1] = model.layers[il].c_attn_proj_w;
+      w[4*il + 2] = model.layers[il].c_mlp_fc_w;
+      w[4*il + 3] = model.layers[il].c_mlp_proj_w;
+    }
+    w[n_w - 1] = model.lm_head;
+    if (params.gemv_bench)
+      gpt2_gemv_bench(w, n_w);
+    if (params.gemv && params.shard) {
+      model.shards = gpt2_shards_init(w, n_w, params.n_threads);
+      if (model.shards == NULL)
+	fprintf(stderr, "%s: failed to place weight shards, decoding without them\n", __func__);
+    }
+    free(w);
+  }
+
+  if (params.exec_bench)
+    gpt2_exec_bench(&model, params.n_threads);
+
+  if (params.draft_model && gpt2_model_init(&draft, &params)) {
+    if (!gpt2_model_load((void *)params.draft_model, params.draft_model_size, &draft, &draft_vocab)) {
+      fprintf(stderr, "%s: failed to load the draft model, decoding without it\n", __func__);
+      gpt2_model_free(&draft);
+    } else if (draft.hparams.n_vocab != model.hparams.n_vocab) {
+      fprintf(stderr, "%s: draft model vocabulary differs, decoding without it\n", __func__);
+      gpt2_model_free(&draft);
+    } else {
+      if (params.fold)
+	gpt2_model_fold(&draft);
+      has_draft = true;
+    }
+  }
+
+  if (params.n_parallel > 1) {
+    /* One prompt per line, reused if there are fewer lines than streams. */
+    int32_t **prompts = calloc(params.n_parallel, sizeof(*prompts));
+    int *prompt_counts = calloc(params.n_parallel, sizeof(*prompt_counts));
+    char *text = strdup(params.prompt);
+    char *saveptr, *line;
+    int n_lines = 0;
+    int64_t t_sample_us = 0, t_predict_us = 0;
+    unsigned long rng = 0;
+    struct gpt2_prefix_cache pc;
+
+    for (line = strtok_r(text, "\n", &saveptr); line != NULL && n_lines < params.n_parallel;
+	 line = strtok_r(NULL, "\n", &saveptr)) {
+      tokenize_words(&vocab, line, prompts + n_lines, prompt_counts + n_lines);
+      n_lines++;
+    }
+    for (int i = n_lines; n_lines && i < params.n_parallel; i++) {
+      prompt_counts[i] = prompt_counts[i % n_lines];
+      prompts[i] = malloc(prompt_counts[i] * sizeof(int32_t));
+      memcpy(prompts[i], prompts[i % n_lines], prompt_counts[i] * sizeof(int32_t));
+    }
+
+    gpt2_prefix_init(&pc, &model.kv, (size_t)params.prefix_cache_mb << 20);
+    gpt2_schedule(&model, &vocab, &params, &pc, prompts, prompt_counts, n_lines ? params.n_parallel : 0,
+		  &rng, &t_predict_us, &t_sample_us);
+
+    printf("%s:     load time = %ld us\n", __func__, t_load_us);
+    printf("%s:   sample time = %ld us\n", __func__, t_sample_us);
+    printf("%s:  predict time = %ld us\n", __func__, t_predict_us);
+    printf("%s:    total time = %ld us\n", __func__, ggml_time_us() - t_main_start_us);
+
+    for (int i = 0; i < params.n_parallel; i++)
+      free(prompts[i]);
+    free(prompts);
+    free(prompt_counts);
+    gpt2_prefix_free(&pc);
+    free(text);
+    goto out;
+  }
+
+  if (params.embedding) {
+    /* One input per line. */
+    int32_t **inputs = NULL;
+    int *counts = NULL, n_inputs = 0;
+    char *text = strdup(params.prompt);
+    char *saveptr, *line;
+    const int n_embd = model.hparams.n_embd;
+    float *out;
+    const int64_t t_start_us = ggml_time_us();
+
+    for (line = strtok_r(text, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+      inputs = realloc(inputs, (n_inputs + 1)*sizeof(*inputs));
+      counts = realloc(counts, (n_inputs + 1)*sizeof(*counts));
+      tokenize_words(&vocab, line, inputs + n_inputs, counts + n_inputs);
+      n_inputs++;
+    }
+
+    out = malloc((size_t)n_inputs*n_embd*sizeof(float));
+    if (gpt2_embed(&model, &model.kv, &params, inputs, counts, n_inputs,
+		   params.embd_mean ? GPT2_EMBD_MEAN : GPT2_EMBD_LAST, out)) {
+      for (int i = 0; i < n_inputs; i++) {
+	const float *e = out + (size_t)i*n_embd;
+
+	printf("%s: input %d: %d tokens, embedding " PRIf " " PRIf " " PRIf " " PRIf " ...\n",
+	       __func__, i, counts[i], FLOATPRINT(e[0]), FLOATPRINT(e[1]),
+	       FLOATPRINT(e[2]), FLOATPRINT(e[3]));
+      }
+      printf("%s: %d embeddings in %ld us\n", __func__, n_inputs, ggml_time_us() - t_start_us);
+    } else {
+      printf("%s: embedding failed\n", __func__);
+    }
+
+    for (int i = 0; i < n_inputs; i++)
+      free(inputs[i]);
+    free(inputs);
+    free(counts);
+    free(out);
+    free(text);
+    goto out;
+  }
+
+  if (params.n_beams > 0) {
+    int32_t *prompt = NULL, *best;
+    int prompt_count = 0, n;
+    const int64_t t_start_us = ggml_time_us();
+
+    tokenize_words(&vocab, params.prompt, &prompt, &prompt_count);
+    best = malloc(params.n_predict*sizeof(int32_t));
+    n = gpt2_beam_search(&model, &model.kv, &params, prompt, prompt_count,
+			 params.n_beams, params.n_predict, best);
+    if (n >= 0) {
+      printf("%s: prompt: '%s'\n", __func__, params.prompt);
+      for (int i = 0; i < n; i++)
+	vocab_print(&vocab, best[i]);
+      printf("\n%s: %d beams, %d tokens in %ld us\n", __func__,
+	     params.n_beams, n, ggml_time_us() - t_start_us);
+    } else {
+      printf("%s: beam search failed\n", __func__);
+    }
+
+    free(prompt);
+    free(best);
+    goto out;
+  }
+
+  if (params.score) {
+    /* The first line is the context, the others are continuations. */
+    int32_t *ctx = NULL, **conts = NULL;
+    int ctx_count = 0, *cont_counts = NULL, n_conts = 0, n_tokens = 0;
+    char *text = strdup(params.prompt);
+    char *saveptr, *line;
+    float *logprobs;
+    const int64_t t_start_us = ggml_time_us();
+
+    line = strtok_r(text, "\n", &saveptr);
+    if (line)
+      tokenize_words(&vocab, line, &ctx, &ctx_count);
+    while ((line = strtok_r(NULL, "\n", &saveptr)) != NULL) {
+      conts = realloc(conts, (n_conts + 1)*sizeof(*conts));
+      cont_counts = realloc(cont_counts, (n_conts + 1)*sizeof(*cont_counts));
+      tokenize_words(&vocab, line, conts + n_conts, cont_counts + n_conts);
+      n_tokens += cont_counts[n_conts++];
+    }
+
+    logprobs = malloc((n_tokens + 1)*sizeof(float));
+    if (gpt2_score(&model, &model.kv, &params, ctx, ctx_count,
+		   conts, cont_counts, n_conts, logprobs)) {
+      for (int c = 0, k = 0; c < n_conts; c++) {
+	float sum = 0.0f;
+
+	for (int j = 0; j < cont_counts[c]; j++)
+	  sum += logprobs[k++];
+	printf("%s: continuation %d: %d tokens, log p = " PRIf "\n", __func__,
+	       c, cont_counts[c], FLOATPRINT(sum));
+      }
+      printf("%s: scored %d tokens in %ld us\n", __func__,
+	     ctx_count + n_tokens, ggml_time_us() - t_start_us);
+    } else {
+      printf("%s: scoring failed\n", __func__);
+    }
+
+    for (int c = 0; c < n_conts; c++)
+      free(conts[c]);
+    free(conts);
+    free(cont_counts);
+    free(ctx);
+    free(logprobs);
+    free(text);
+    goto out;
+  }
+
+  if (params.tp_groups > 1) {
+    tp = gpt2_tp_init(&model, params.tp_groups, params.n_threads);
+    if (tp == NULL)
+      fprintf(stderr, "%s: tensor-parallel mode not available, using the full graph\n", __func__);
+  }
+
   int n_past = 0;
 
   int64_t t_sample_us  = 0;
   int64_t t_predict_us = 0;
+  int64_t t_prefill_us = 0;
+  int n_prefill = 0;
+  const enum gpt2_logits logits_rows = params.logits_all ? GPT2_LOGITS_ALL : GPT2_LOGITS_LAST;
 
-  int32_t *embd_inp = NULL;
   int embd_inp_count = 0;
 
   tokenize_words(&vocab, params.prompt, &embd_inp, &embd_inp_count);
 
 #define MIN(_a,_b) ((_a) < (_b) ? (_a) : (_b))
-  params.n_predict = MIN(params.n_predict, model.hparams.n_ctx - embd_inp_count);
+  if (!params.ctx_shift)
+    params.n_predict = MIN(params.n_predict, model.hparams.n_ctx - embd_inp_count);
   printf("%s: prompt: '%s'\n", __func__, params.prompt);
   printf("%s: number of tokens in prompt = %zu, first 8 tokens: ", __func__,
 	 embd_inp_count);
@@ -769,27 +2326,56 @@ void _gpt2_init(void *unused)
   printf("\n\n");
 
   int32_t vect[4] = { 0, 1, 2, 3};
-  struct fvec logits;
-  size_t mem_per_token;
-
-  fvec_init (&logits);
-
-  gpt2_eval(&model, params.n_threads, 0, vect, 4, &logits, &mem_per_token);
+  size_t mem_per_token = 0;
+  unsigned long rng = 0;
+
+  gpt2_eval(&model, &model.kv, params.n_threads, 0, vect, 4, logits_rows, &logits, &mem_per_token);
+
+  if (params.kv_snapshot) {
+    /* Resume the parked context, the prompt continues it. This comes
+       after the warm up evaluation, which writes rows 0 to 3. */
+    const int32_t *ctx_tokens;
+    const int n = gpt2_kv_restore(&model, &model.kv, params.kv_snapshot,
+				  params.kv_snapshot_size, &ctx_tokens);
+
+    if (n > 0) {
+      for (int i = 0; i < n; i++)
+	vocab_print(&vocab, ctx_tokens[i]);
+      n_past = n;
+      if (!params.ctx_shift)
+	params.n_predict = MIN(params.n_predict, model.hparams.n_ctx - n_past - embd_inp_count);
+    }
+  }
 
-  int32_t *embd = NULL;
   int embd_count = 0;
+  bool embd_is_prompt = false;
 
   for (size_t i = embd_count; i < embd_inp_count + params.n_predict; i++) {
     // predict
     if (embd_count > 0) {
 
+      if (params.ctx_shift && n_past + embd_count > model.kv.n_ctx_max) {
+	const int n_discard = (n_past - params.n_keep)/2;
+
+	gpt2_kv_shift(&model.kv, params.n_keep, n_discard, n_past);
+	n_past -= n_discard;
+      }
+
       const int64_t t_start_us = ggml_time_us();
 
-      if (!gpt2_eval(&model, params.n_threads, n_past, embd, embd_count, &logits, &mem_per_token)) {
+      const bool ok = tp && !params.logits_all ?
+	gpt2_eval_tp(&model, &model.kv, tp, n_past, embd, embd_count, &logits) :
+	gpt2_eval(&model, &model.kv, params.n_threads, n_past, embd, embd_count, logits_rows, &logits, &mem_per_token);
+
+      if (!ok) {
 	printf("Failed to predict\n");
-	return;
+	goto out;
       }
       t_predict_us += ggml_time_us() - t_start_us;
+      if (embd_is_prompt) {
+	t_prefill_us += ggml_time_us() - t_start_us;
+	n_prefill += embd_count;
+      }
 	    
     }
 
@@ -809,13 +2395,33 @@ void _gpt2_init(void *unused)
       int32_t id = 0;
 
       {
-	static unsigned long rng = 0;
 	const int64_t t_start_sample_us = ggml_time_us();
 	id = gpt_sample_top_k_top_p(fvec_data(&logits) + fvec_size(&logits) - n_vocab, n_vocab, top_k, top_p, temp, &rng);
 	t_sample_us += ggml_time_us() - t_start_sample_us;
       }
+
+      /* The draft needs the whole context, a restored one is not
+	 in embd_inp. */
+      if (has_draft && !tp && id != GPT2_EOS && n_past == embd_inp_count) {
+	n_past += gpt2_decode_speculative(&model, &model.kv, &draft, &vocab, &params,
+					  embd_inp, n_past, id,
+					  embd_inp_count + params.n_predict - i - 1,
+					  &rng,
+					  &t_predict_us, &t_sample_us);
+	break;
+      }
+
+      if (params.pipeline && !tp && id != GPT2_EOS) {
+	n_past += gpt2_decode_pipelined(&model, &model.kv, &vocab, &params, n_past, id,
+					embd_inp_count + params.n_predict - i - 1,
+					&rng,
+					&t_predict_us, &t_sample_us);
+	break;
+      }
+
       embd = realloc(embd, (embd_count + 1) * sizeof(*embd));
       embd[embd_count++] = id;
+      embd_is_prompt = false;
     } else {
       // if here, it means we are still processing the input prompt
       for (size_t k = i; k < embd_inp_count; k++) {
@@ -826,6 +2432,7 @@ void _gpt2_init(void *unused)
 	}
       }
       i += embd_count - 1;
+      embd_is_prompt = true;
     }
 
     // display text
@@ -836,24 +2443,39 @@ void _gpt2_init(void *unused)
     }
 
     // end of text token
-    if (embd[embd_count] == 50256) {
+    if (embd[embd_count - 1] == GPT2_EOS) {
       break;
     }
 
   }
 
+  /* Done with this request, keep only the first chunk. */
+  gpt2_kv_shrink(&model.kv, 0);
+
   // report timing
   {
     const int64_t t_main_end_us = ggml_time_us();
 
     printf("\n\n");
-    printf("%s: mem per token = %8zu bytes\n", __func__, mem_per_token);
+    printf("%s: mem per token = %8zu bytes (compute buffer / N)\n", __func__, mem_per_token);
     printf("%s:     load time = %ld us\n", __func__, t_load_us);
     printf("%s:   sample time = %ld us\n", __func__, t_sample_us);
     printf("%s:  predict time = %ld us / %ld us per token\n", __func__, t_predict_us, t_predict_us/n_past);
+    if (n_prefill)
+      printf("%s:  prefill time = %ld us / %ld us per token (%s logits)\n", __func__,
+	     t_prefill_us, t_prefill_us/n_prefill, params.logits_all ? "all" : "last");
     printf("%s:    total time = %ld us\n", __func__, (t_main_end_us - t_main_start_us));
   }
 
-  ggml_free(model.ctx_w);
-
+  if (model.shards)
+    gpt2_shards_report(model.shards);
+
+ out:
+  free(embd);
+  free(embd_inp);
+  fvec_free(&logits);
+  gpt2_tp_free(tp);
+  if (has_draft)
+    gpt2_model_free(&draft);
+  gpt2_model_free(&model);
 }
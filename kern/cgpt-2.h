@@ -0,0 +1,380 @@
+#ifndef _CGPT_2_H
+#define _CGPT_2_H
+
+/*
+  Model, memory and graph building of cgpt-2.c, shared with the
+  decoding and evaluation modes built on them: cgpt-decode.c
+  (pipelined and speculative decode), cgpt-tp.c (tensor-parallel),
+  cgpt-modes.c (scoring, beam search, embeddings) and cgpt-pp.c
+  (layer-pipelined batches and their scheduler).
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "util.h"
+#include "cgpt-common.h"
+
+#define GPT2_EOS 50256
+
+// default hparams (GPT-2 117M)
+struct gpt2_hparams {
+  int32_t n_vocab;
+  int32_t n_ctx;
+  int32_t n_embd;
+  int32_t n_head;
+  int32_t n_layer;
+  int32_t ftype;
+  float   eps;
+};
+
+struct gpt2_layer {
+    // normalization
+    struct ggml_tensor * ln_1_g;
+    struct ggml_tensor * ln_1_b;
+
+    struct ggml_tensor * ln_2_g;
+    struct ggml_tensor * ln_2_b;
+
+    // attention
+    struct ggml_tensor * c_attn_attn_w;
+    struct ggml_tensor * c_attn_attn_b;
+
+    struct ggml_tensor * c_attn_proj_w;
+    struct ggml_tensor * c_attn_proj_b;
+
+    // mlp
+    struct ggml_tensor * c_mlp_fc_w;
+    struct ggml_tensor * c_mlp_fc_b;
+
+    struct ggml_tensor * c_mlp_proj_w;
+    struct ggml_tensor * c_mlp_proj_b;
+};
+
+/*
+  Key + value memory of one sequence. Rows of layer il start at row
+  il*n_ctx of each tensor.
+
+  The memory grows on demand, GPT2_KV_CHUNK rows per layer at a time,
+  up to n_ctx_max. Graphs view it with stride n_ctx, so they must be
+  built after the rows they use have been reserved.
+*/
+#define GPT2_KV_CHUNK 128
+
+struct gpt2_kv_cache {
+    struct ggml_context * ctx;
+
+    struct ggml_tensor * k; // [n_embd*n_ctx*n_layer]
+    struct ggml_tensor * v; // [n_embd*n_ctx*n_layer]
+
+    enum ggml_type type;
+    int n_ctx;     // rows per layer allocated
+    int n_ctx_max; // rows per layer at most
+    int n_embd;    // row size
+    int n_layer;
+
+    // v is stored transposed: [n_ctx, n_embd] per layer
+    bool v_trans;
+};
+
+struct gpt2_model {
+    struct gpt2_hparams hparams;
+
+    // normalization
+    struct ggml_tensor * ln_f_g;
+    struct ggml_tensor * ln_f_b;
+
+    struct ggml_tensor * wte;     // position embedding
+    struct ggml_tensor * wpe;     //    token embedding
+    struct ggml_tensor * lm_head; // language model head
+
+    struct gpt2_layer *layers;
+
+    // key + value memory of the default sequence
+    struct gpt2_kv_cache kv;
+
+    // ln_1, ln_2 and the KQ scale are folded into the weights
+    bool folded;
+
+    // fused attention over an F16 key + value memory
+    bool flash_attn;
+
+    // KV memories store V transposed, see gpt2_kv_cache
+    bool v_trans;
+
+    // single token products use the kernels of cgpt-gemv.c
+    bool gemv;
+
+    // per compute thread copies of the weight rows, or NULL
+    struct gpt2_shards *shards;
+
+    // products of batches this large or more use BLIS, 0: never
+    int gemm_n;
+
+    // decode graphs run by cgpt-exec.c with this window, 0: ggml
+    int exec_window;
+
+    // graphs of gpt2_eval(), one per model
+    struct gpt2_scratch *scratch;
+
+    //
+    struct ggml_context * ctx_w;
+    struct hashmap tensors;
+};
+
+/*
+  Output of the graph: logits for some rows of the batch or, skipping
+  lm_head, the final hidden state pooled per sequence.
+*/
+enum gpt2_logits {
+  GPT2_LOGITS_LAST, /* Last token only, for sampling. */
+  GPT2_LOGITS_ALL,  /* Every token, for scoring. */
+  GPT2_EMBD_LAST,   /* Hidden state of the last token of each sequence. */
+  GPT2_EMBD_MEAN,   /* Mean hidden state of each sequence. */
+};
+
+/*
+  Memory for evaluating graphs.
+
+  'buf' only holds the tensor and graph metadata. Intermediate tensors
+  are placed by the graph allocator, which measures the graph and
+  reuses memory between tensors whose lifetimes do not overlap: its
+  buffer is exactly the peak of the largest graph built so far.
+*/
+struct gpt2_scratch {
+  void *buf;
+  size_t size;
+
+  ggml_gallocr_t allocr;
+  size_t compute_size;
+
+  /*
+    Compute plans, one per model and graph shape, and the work buffer
+    shared by all of them. See gpt2_plan().
+  */
+#define GPT2_MAX_PLANS 8
+  struct gpt2_plan {
+    // the model and the settings that change its graph
+    const struct gpt2_model *model;
+    bool folded;
+    bool flash_attn;
+    bool v_trans;
+    bool gemv;
+    const struct gpt2_shards *shards;
+    int gemm_n;
+
+    int N;
+    enum gpt2_logits mode;
+    int n_out;
+    int n_ctx;
+    bool masked;
+    struct ggml_cplan cplan;
+  } plans[GPT2_MAX_PLANS];
+  int n_plans;
+
+  uint8_t *work;
+  size_t work_size;
+
+  /* Dependency driven executor, made on first use. */
+  struct gpt2_exec *exec;
+};
+
+/*
+  Several independent sequences in one batch, after a KV prefix they
+  all share: batch token i is at position pos[i] and attends to the
+  n_past shared rows and to the batch tokens of sequence seq[i] up to
+  itself. Embeddings are pooled per sequence, seq[i] < n_seq.
+
+  If 'cell_seq' is given, the first n_past rows are not all shared:
+  row j is only seen by the sequences whose bit is set in cell_seq[j].
+*/
+struct gpt2_batch_layout {
+  const int32_t *pos;
+  const int32_t *seq;
+  int n_seq;
+  const uint64_t *cell_seq;
+};
+
+/*
+  A built, not yet computed, evaluation graph.
+
+  The token ids are not part of the graph structure: they are written
+  into 'embd' right before computing, so a graph can be prepared before
+  the tokens it will process are known.
+*/
+struct gpt2_graph {
+  struct gpt2_scratch *s;
+  const struct gpt2_kv_cache *kv;
+  struct ggml_context *ctx;
+  struct ggml_cgraph *gf;
+
+  struct ggml_tensor *embd;     /* [N] input token ids. */
+  struct ggml_tensor *position; /* [N] input positions. */
+  struct ggml_tensor *kq_mask;  /* Input attention mask, or NULL. */
+  struct ggml_tensor *pool;     /* [N, n_out] input pooling matrix, or NULL. */
+  struct ggml_tensor *logits;   /* [n_vocab, n_out] or [n_embd, n_out] output. */
+
+  enum gpt2_logits mode;
+  int n_past;
+  int N;
+  int n_out; /* Output rows: the last n_out tokens, or the sequences. */
+};
+
+struct gpt2_prefix_cache;
+struct gpt2_tp;
+struct gpt2_pp;
+struct gpt2_pp_batch;
+
+/* cgpt-2.c */
+bool gpt2_kv_init(const struct gpt2_model *model, const int n_ctx_max, struct gpt2_kv_cache *kv);
+bool gpt2_kv_reserve(struct gpt2_kv_cache *kv, const int n_past, const int n);
+void gpt2_kv_shrink(struct gpt2_kv_cache *kv, const int n_past);
+void gpt2_kv_free(struct gpt2_kv_cache *kv);
+size_t gpt2_kv_rows_size(const struct gpt2_kv_cache *kv, const int n);
+void gpt2_kv_rows(const struct gpt2_kv_cache *kv, const int p0, const int n, void *buf, bool write);
+void gpt2_kv_shift(struct gpt2_kv_cache *kv, const int n_keep, const int n_discard, const int n_past);
+
+void gpt2_prefix_init(struct gpt2_prefix_cache *pc, const struct gpt2_kv_cache *kv, const size_t max_size);
+void gpt2_prefix_free(struct gpt2_prefix_cache *pc);
+int gpt2_prefix_lookup(struct gpt2_prefix_cache *pc, struct gpt2_kv_cache *kv,
+		       const int32_t *tokens, const int n);
+void gpt2_prefix_insert(struct gpt2_prefix_cache *pc, const struct gpt2_kv_cache *kv,
+			const int32_t *tokens, const int n);
+
+bool gpt2_scratch_init(struct gpt2_scratch *s);
+void gpt2_scratch_free(struct gpt2_scratch *s);
+bool gpt2_scratch_work(struct gpt2_scratch *s, const size_t size);
+
+struct ggml_tensor *gpt2_norm(struct ggml_context *ctx, struct ggml_tensor *x,
+			      struct ggml_tensor *g, struct ggml_tensor *b, float eps);
+struct ggml_tensor *gpt2_build_layer(const struct gpt2_model *model,
+				     const struct gpt2_kv_cache *kv,
+				     struct ggml_context *ctx0,
+				     struct ggml_cgraph *gf,
+				     const int il,
+				     const int n_past,
+				     const int N,
+				     struct ggml_tensor *KQ_mask,
+				     struct ggml_tensor *inpL);
+bool gpt2_build_batch(const struct gpt2_model *model,
+		      const struct gpt2_kv_cache *kv,
+		      struct gpt2_scratch *s,
+		      const int n_past,
+		      const int N,
+		      enum gpt2_logits logits,
+		      const struct gpt2_batch_layout *bl,
+		      struct gpt2_graph *g);
+bool gpt2_build(const struct gpt2_model *model,
+		const struct gpt2_kv_cache *kv,
+		struct gpt2_scratch *s,
+		const int n_past,
+		const int N,
+		enum gpt2_logits logits,
+		struct gpt2_graph *g);
+
+struct ggml_cplan *gpt2_plan_find(struct gpt2_scratch *s, const struct gpt2_model *model,
+				  const struct gpt2_kv_cache *kv, const int N, enum gpt2_logits mode,
+				  const int n_out, const bool masked, const int n_threads);
+struct ggml_cplan *gpt2_plan_add(struct gpt2_scratch *s, const struct gpt2_model *model,
+				 const struct gpt2_kv_cache *kv, const int N, enum gpt2_logits mode,
+				 const int n_out, const bool masked, struct ggml_cgraph *gf,
+				 const int n_threads);
+struct ggml_context *gpt2_plan_ctx(const struct gpt2_scratch *s, const struct gpt2_kv_cache *kv,
+				   struct gpt2_kv_cache *wkv);
+void gpt2_plan_ctx_free(struct ggml_context *ctx);
+struct ggml_cplan *gpt2_plan(const struct gpt2_model *model, const struct gpt2_kv_cache *kv,
+			     struct gpt2_scratch *s,
+			     const int N, enum gpt2_logits mode, const int n_out, const bool masked,
+			     const int n_threads);
+
+bool gpt2_compute(const struct gpt2_model *model, struct gpt2_graph *g, const int n_threads);
+void gpt2_graph_free(struct gpt2_graph *g);
+bool gpt2_eval(const struct gpt2_model *model,
+	       struct gpt2_kv_cache *kv,
+	       const int n_threads,
+	       const int n_past,
+	       int32_t *embd_inp,
+	       int embd_inp_count,
+	       enum gpt2_logits logits,
+	       struct fvec *embd_w,
+	       size_t *mem_per_token);
+
+/* cgpt-decode.c */
+int gpt2_decode_pipelined(const struct gpt2_model *model,
+			  struct gpt2_kv_cache *kv,
+			  struct vocab *vocab,
+			  const struct gpt_params *params,
+			  int n_past,
+			  int32_t id,
+			  int n_predict,
+			  unsigned long *rng,
+			  int64_t *t_predict_us,
+			  int64_t *t_sample_us);
+int gpt2_decode_speculative(const struct gpt2_model *model,
+			    struct gpt2_kv_cache *kv,
+			    const struct gpt2_model *draft,
+			    struct vocab *vocab,
+			    const struct gpt_params *params,
+			    const int32_t *ctx,
+			    int n_past,
+			    int32_t id,
+			    int n_predict,
+			    unsigned long *rng,
+			    int64_t *t_predict_us,
+			    int64_t *t_sample_us);
+
+/* cgpt-tp.c */
+struct gpt2_tp *gpt2_tp_init(const struct gpt2_model *model, const int n_groups, const int n_threads);
+void gpt2_tp_free(struct gpt2_tp *tp);
+bool gpt2_eval_tp(const struct gpt2_model *model,
+		  struct gpt2_kv_cache *kv,
+		  struct gpt2_tp *tp,
+		  const int n_past,
+		  const int32_t *embd_inp,
+		  const int N,
+		  struct fvec *logits);
+
+/* cgpt-modes.c */
+bool gpt2_score(const struct gpt2_model *model,
+		struct gpt2_kv_cache *kv,
+		const struct gpt_params *params,
+		const int32_t *ctx,
+		const int n_ctx_tokens,
+		int32_t **conts,
+		const int *cont_counts,
+		const int n_conts,
+		float *logprobs);
+int gpt2_beam_search(const struct gpt2_model *model,
+		     struct gpt2_kv_cache *kv,
+		     const struct gpt_params *params,
+		     const int32_t *prompt,
+		     const int n_prompt,
+		     const int n_beams,
+		     const int n_predict,
+		     int32_t *best);
+bool gpt2_embed(const struct gpt2_model *model,
+		struct gpt2_kv_cache *kv,
+		const struct gpt_params *params,
+		int32_t **inputs,
+		const int *counts,
+		const int n_inputs,
+		enum gpt2_logits mode,
+		float *out);
+
+/* cgpt-pp.c */
+struct gpt2_pp *gpt2_pp_init(const struct gpt2_model *model, const int n_stages, const int n_threads);
+void gpt2_pp_free(struct gpt2_pp *pp);
+bool gpt2_pp_eval(struct gpt2_pp *pp, struct gpt2_pp_batch *batches, const int n);
+bool gpt2_schedule(const struct gpt2_model *model,
+		   struct vocab *vocab,
+		   const struct gpt_params *params,
+		   struct gpt2_prefix_cache *pc,
+		   int32_t **prompts,
+		   int *prompt_counts,
+		   const int n_seq,
+		   unsigned long *rng,
+		   int64_t *t_predict_us,
+		   int64_t *t_sample_us);
+
+#endif
@@ -209,13 +209,17 @@ rand_r (unsigned long *seed)
   return (*seed >> 16) & 0x7FFF;
 }
 
-int32_t
-gpt_sample_top_k_top_p (const float *logits,
-                        int vocab_size,
-                        int top_k,
-                        float top_p,
-                        float temp,
-                        unsigned long *rng_state)
+/* Sort the logits of 'logits' scaled by 'temp' in *ids and leave in
+   *probs the normalized probabilities of the first ones kept by top_k
+   and top_p. Returns how many are kept. */
+static int
+gpt_top_k_top_p (const float *logits,
+                 int vocab_size,
+                 int top_k,
+                 float top_p,
+                 float temp,
+                 sort_e **ids,
+                 float **probs_out)
 {
   /* Allocate memory for sorted logits */
   sort_e *logits_id = malloc (sizeof (sort_e) * vocab_size);
@@ -288,6 +292,25 @@ gpt_sample_top_k_top_p (const float *logits,
       vocab_size = new_size;
     }
 
+  *ids = logits_id;
+  *probs_out = probs;
+  return vocab_size;
+}
+
+int32_t
+gpt_sample_top_k_top_p (const float *logits,
+                        int vocab_size,
+                        int top_k,
+                        float top_p,
+                        float temp,
+                        unsigned long *rng_state)
+{
+  sort_e *logits_id;
+  float *probs;
+
+  vocab_size = gpt_top_k_top_p (logits, vocab_size, top_k, top_p, temp,
+                                &logits_id, &probs);
+
   /* Generate a random number for sampling */
   float rand_val = ((float) rand_r (rng_state)) / RAND_MAX;
 
@@ -301,3 +324,40 @@ gpt_sample_top_k_top_p (const float *logits,
 
   return result;
 }
+
+void
+gpt_probs_top_k_top_p (const float *logits,
+                       int vocab_size,
+                       int top_k,
+                       float top_p,
+                       float temp,
+                       float *probs)
+{
+  sort_e *logits_id;
+  float *kept;
+  int n;
+
+  n = gpt_top_k_top_p (logits, vocab_size, top_k, top_p, temp,
+                       &logits_id, &kept);
+
+  memset (probs, 0, sizeof (float) * vocab_size);
+  for (int i = 0; i < n; i++)
+    {
+      probs[logits_id[i].id] = kept[i];
+    }
+
+  free (logits_id);
+  free (kept);
+}
+
+float
+gpt_rand_uniform (unsigned long *rng_state)
+{
+  return ((float) rand_r (rng_state)) / RAND_MAX;
+}
+
+int32_t
+gpt_sample_probs (float *probs, int vocab_size, unsigned long *rng_state)
+{
+  return discrete_sample (probs, vocab_size, gpt_rand_uniform (rng_state));
+}
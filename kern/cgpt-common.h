@@ -7,10 +7,33 @@ struct gpt_params {
   int32_t n_predict;
   int32_t n_parallel;
   int32_t n_batch;
+  int32_t n_step_tokens;
+  int32_t prefix_cache_mb;
   int32_t n_ctx;
   int32_t n_gpu_layers;
 
   bool ignore_eos;
+  bool pipeline;
+  bool fold;
+  bool fold_check;
+  bool flash_attn;
+  bool v_trans;
+  bool gemv;
+  bool gemv_bench;
+  bool shard;
+  int32_t tp_groups;
+  int32_t pp_stages;
+  int32_t exec_window;
+  bool exec_bench;
+  int32_t gemm_n;
+  bool gemm_bench;
+  bool logits_all;
+  bool ctx_shift;
+  bool score;
+  bool embedding;
+  bool embd_mean;
+  int32_t n_keep;
+  int32_t n_beams;
 
   int32_t top_k;
   float   top_p;
@@ -19,9 +42,15 @@ struct gpt_params {
   float   repeat_penalty;
 
   const char *model;
+  const void *draft_model;
+  size_t draft_model_size;
+  int32_t n_draft;
   char *prompt;
   char *token_test;
 
+  const void *kv_snapshot;
+  size_t kv_snapshot_size;
+
   bool    interactive;
   int32_t interactive_port;
 };
@@ -33,10 +62,33 @@ static inline void gpt_params_default(struct gpt_params *p)
   p->n_predict = 200; /* New tokens to predict */
   p->n_parallel = 1; /* Number of parallel streams. */
   p->n_batch = 32; /* batch size for prompt processing. */
+  p->n_step_tokens = 64; /* Tokens evaluated per step across parallel streams. */
+  p->prefix_cache_mb = 128; /* Memory for KV rows of already evaluated prompt prefixes. */
   p->n_ctx = 2048; /* context size (this is the KV cache max size) */
   p->n_gpu_layers = 0; /* Numer of layers to offload to the GPU */
 
   p->ignore_eos = false; /* Ignore EOS token when generating text */
+  p->pipeline = false; /* Build next decode step while computing, on a CPU taken from the compute threads */
+  p->fold = false; /* Fold layer norm parameters and KQ scale into the weights at load */
+  p->fold_check = false; /* With fold, check folded logits against the unfolded graph */
+  p->flash_attn = false; /* Fused attention reading an F16 KV memory in place */
+  p->v_trans = true; /* Store V transposed in the KV memory (ignored with flash_attn) */
+  p->gemv = true; /* Shape specialized kernels for single token products, see cgpt-gemv.c */
+  p->gemv_bench = false; /* Time the GEMV kernels against STREAM after loading */
+  p->shard = false; /* Each compute thread keeps a copy of its rows of the weights (needs gemv) */
+  p->tp_groups = 0; /* Split heads and MLP among this many CPU groups of n_threads/tp_groups (0: off) */
+  p->pp_stages = 0; /* With n_parallel, pipeline the layers over this many CPU groups (0: off) */
+  p->gemm_n = 0; /* Prefill products of this many tokens or more use BLIS sgemm (0: ggml) */
+  p->gemm_bench = false; /* Compare prefill tokens/s of ggml and BLIS for a few batch sizes */
+  p->exec_window = 0; /* Run decode graphs without barriers, nodes this far apart overlap (0: ggml, 1: in order) */
+  p->exec_bench = true; /* Report decode time and CPU wait per token for ggml and the executor */
+  p->logits_all = false; /* Compute logits for every batch row, not just the last */
+  p->ctx_shift = false; /* Drop old KV rows when the context is full instead of stopping */
+  p->n_keep = 4; /* Initial rows never dropped by a context shift */
+  p->score = false; /* Score the prompt lines after the first as continuations of it */
+  p->embedding = false; /* Print an embedding of each prompt line instead of generating */
+  p->embd_mean = true; /* Mean of the token hidden states, else the last one */
+  p->n_beams = 0; /* Beam search of this width instead of sampling (0: off) */
 
   /* Sampling parameters. */
   p->top_k = 40;
@@ -46,9 +98,15 @@ static inline void gpt_params_default(struct gpt_params *p)
   p->repeat_penalty = 1.00f;
 
   p->model = "MODELFILE";
+  p->draft_model = NULL; /* Mapped draft model for speculative decoding, same vocabulary */
+  p->draft_model_size = 0;
+  p->n_draft = 4; /* Tokens proposed by the draft model per step */
   p->prompt = "";
   p->token_test = "";
 
+  p->kv_snapshot = NULL; /* KV snapshot to resume from, see gpt2_kv_snapshot() */
+  p->kv_snapshot_size = 0;
+
   p->interactive = false;
   p->interactive_port = -1;
 }
@@ -63,4 +121,22 @@ gpt_sample_top_k_top_p (const float *logits,
                         float temp,
                         unsigned long *rng_state);
 
+/* The distribution gpt_sample_top_k_top_p() samples from, over the
+   whole vocabulary: 'probs' holds vocab_size entries. */
+void
+gpt_probs_top_k_top_p (const float *logits,
+                       int vocab_size,
+                       int top_k,
+                       float top_p,
+                       float temp,
+                       float *probs);
+
+/* Uniform in [0, 1]. */
+float
+gpt_rand_uniform (unsigned long *rng_state);
+
+/* Sample an index of 'probs', which sums to 1. */
+int32_t
+gpt_sample_probs (float *probs, int vocab_size, unsigned long *rng_state);
+
 #endif
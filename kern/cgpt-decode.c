@@ -0,0 +1,334 @@
+/*
+  Single sequence decode modes of cgpt-2.c: pipelined decode, which
+  builds the next graph while the current one computes, and
+  speculative decode with a draft model.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nux/nux.h>
+#include <nuxcompute.h>
+#include "ggml.h"
+
+#include "util.h"
+#include "cgpt-common.h"
+#include "cgpt-2.h"
+
+/*
+  Pipelined decode.
+
+  While the compute CPUs run step t, a helper CPU from the NUX compute
+  pool prints the token fed to step t and builds the graph of step t+1
+  in the other scratch buffer. The graph of a single-token step does
+  not depend on the token itself, so the only serial work left between
+  two computes is sampling.
+*/
+struct gpt2_pipeline {
+  const struct gpt2_model *model;
+  const struct gpt2_kv_cache *kv;
+  struct vocab *vocab;
+
+  struct gpt2_scratch scratch[2];
+  struct gpt2_graph graph[2];
+  int cur;
+
+  /* Helper CPU work description. */
+  int32_t emit_id;
+  int next_n_past;
+  bool next_ok;
+};
+
+static void
+gpt2_pipeline_helper(void *arg)
+{
+  struct gpt2_pipeline *p = arg;
+  const int next = p->cur ^ 1;
+
+  vocab_print(p->vocab, p->emit_id);
+
+  if (p->next_n_past >= 0)
+    p->next_ok = gpt2_build(p->model, p->kv, p->scratch + next, p->next_n_past, 1,
+			   GPT2_LOGITS_LAST, p->graph + next);
+}
+
+/*
+  Generate up to 'n_predict' tokens after 'id', which has been sampled
+  but neither printed nor evaluated yet. Returns the number of tokens
+  evaluated.
+*/
+int gpt2_decode_pipelined(const struct gpt2_model *model,
+			  struct gpt2_kv_cache *kv,
+			  struct vocab *vocab,
+			  const struct gpt_params *params,
+			  int n_past,
+			  int32_t id,
+			  int n_predict,
+			  unsigned long *rng,
+			  int64_t *t_predict_us,
+			  int64_t *t_sample_us)
+{
+  const int n_vocab = model->hparams.n_vocab;
+  const int n_ctx   = kv->n_ctx_max;
+  /* One CPU of the pool is used by the helper. */
+  const int n_threads = params->n_threads > 1 ? params->n_threads - 1 : 1;
+
+  struct gpt2_pipeline p;
+  int n_eval = 0;
+
+  memset(&p, 0, sizeof(p));
+  p.model = model;
+  p.kv = kv;
+  p.vocab = vocab;
+
+  for (int i = 0; i < 2; i++)
+    if (!gpt2_scratch_init(p.scratch + i))
+      return 0;
+
+  /* Graphs are built ahead: grow the memory now, not between steps. */
+  if (n_past >= n_ctx || n_predict <= 0
+      || !gpt2_kv_reserve(kv, n_past, n_past + n_predict < n_ctx ? n_past + n_predict : n_ctx)
+      || !gpt2_build(model, kv, p.scratch, n_past, 1, GPT2_LOGITS_LAST, p.graph))
+    {
+      vocab_print(vocab, id);
+      return 0;
+    }
+
+  bool ok = true;
+
+  while (true) {
+    struct gpt2_graph *g = p.graph + p.cur;
+    /* With a context shift, the next step runs on the shifted memory. */
+    const bool shift = params->ctx_shift && n_past + 1 >= n_ctx;
+    const int n_discard = shift ? (n_past + 1 - params->n_keep)/2 : 0;
+    const bool last = n_eval + 1 >= n_predict || (!shift && n_past + 1 >= n_ctx);
+    unsigned helper;
+
+    ((int32_t *)g->embd->data)[0] = id;
+
+    p.emit_id = id;
+    p.next_n_past = last ? -1 : n_past + 1 - n_discard;
+    p.next_ok = false;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    helper = nuxcompute_allocate_cpu(gpt2_pipeline_helper, &p);
+    ok = gpt2_compute(model, g, n_threads);
+    if (helper != CPU_INVALID)
+      nuxcompute_wait_cpu(helper);
+    else
+      gpt2_pipeline_helper(&p);
+    if (!ok) {
+      /* 'id' has been printed by the helper already. */
+      gpt2_graph_free(g);
+      break;
+    }
+
+    *t_predict_us += ggml_time_us() - t_start_us;
+    if (n_discard)
+      gpt2_kv_shift(kv, params->n_keep, n_discard, n_past + 1);
+    n_past += 1 - n_discard;
+    n_eval++;
+
+    {
+      const int64_t t_start_sample_us = ggml_time_us();
+      id = gpt_sample_top_k_top_p((float *)ggml_get_data(g->logits), n_vocab,
+				  params->top_k, params->top_p, params->temp, rng);
+      *t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+
+    gpt2_graph_free(g);
+
+    if (last || id == GPT2_EOS || !p.next_ok)
+      break;
+
+    p.cur ^= 1;
+  }
+
+  if (ok)
+    vocab_print(vocab, id);
+
+  if (p.next_ok)
+    gpt2_graph_free(p.graph + (p.cur ^ 1));
+  gpt2_scratch_free(p.scratch + 0);
+  gpt2_scratch_free(p.scratch + 1);
+  return n_eval;
+}
+
+/*
+  Speculative decoding.
+
+  The draft model proposes n_draft tokens one at a time, then the model
+  evaluates the sampled token and all the drafts in a single batch with
+  logits for every row. A decode step is bound by reading the weights,
+  so a batch of n_draft + 1 rows costs little more than a single one.
+
+  Drafts are checked in order with the speculative sampling rule: with
+  p and q the distributions the model and the draft sample from (after
+  top_k, top_p and temp), draft x is accepted with probability
+  min(1, p(x)/q(x)). The first rejected one is replaced by a sample of
+  max(0, p - q), normalized, and if all are accepted the next token is
+  sampled from the model's last row. The tokens generated follow the
+  model's distribution, as in a plain decode.
+
+  Rows of rejected tokens are rolled back by not advancing n_past past
+  them; the next batch overwrites them.
+
+  'ctx' are the 'n_past' tokens already in 'kv', the draft evaluates
+  them first. Generation stops at the end of the context. Returns the
+  number of tokens generated.
+*/
+int gpt2_decode_speculative(const struct gpt2_model *model,
+			    struct gpt2_kv_cache *kv,
+			    const struct gpt2_model *draft,
+			    struct vocab *vocab,
+			    const struct gpt_params *params,
+			    const int32_t *ctx,
+			    int n_past,
+			    int32_t id,
+			    int n_predict,
+			    unsigned long *rng,
+			    int64_t *t_predict_us,
+			    int64_t *t_sample_us)
+{
+  const int n_vocab = model->hparams.n_vocab;
+  const int n_ctx = kv->n_ctx_max < draft->hparams.n_ctx ? kv->n_ctx_max : draft->hparams.n_ctx;
+  int32_t *batch = malloc((params->n_draft + 1)*sizeof(int32_t));
+  /* Draft distribution of each draft, model distribution of a row. */
+  float *q = malloc((size_t)params->n_draft*n_vocab*sizeof(float));
+  float *p = malloc(n_vocab*sizeof(float));
+  struct gpt2_kv_cache dkv;
+  struct fvec logits;
+  size_t mem_per_token = 0;
+  int n_gen = 0, n_drafted = 0, n_accepted = 0, n_passes = 0;
+  int64_t t_draft_us = 0;
+  bool eos = false;
+  const int64_t t_start_us = ggml_time_us();
+
+  fvec_init(&logits);
+  memset(&dkv, 0, sizeof(dkv));
+  if (batch == NULL || (params->n_draft && q == NULL) || p == NULL
+      || !gpt2_kv_init(draft, n_ctx, &dkv))
+    goto out;
+
+  /* Bring the draft to the same context. */
+  for (int i = 0; i < n_past; i += params->n_batch) {
+    const int n = n_past - i < params->n_batch ? n_past - i : params->n_batch;
+
+    if (!gpt2_eval(draft, &dkv, params->n_threads, i, (int32_t *)ctx + i, n,
+		   GPT2_LOGITS_LAST, &logits, &mem_per_token))
+      goto out;
+  }
+  t_draft_us += ggml_time_us() - t_start_us;
+
+  while (n_gen < n_predict && n_past < n_ctx) {
+    /* Drafts cannot go past the context or the tokens left. */
+    int n_draft = params->n_draft;
+    int n_ok = 0;
+
+    if (n_draft > n_ctx - n_past - 1)
+      n_draft = n_ctx - n_past - 1;
+    if (n_draft > n_predict - n_gen - 1)
+      n_draft = n_predict - n_gen - 1;
+
+    batch[0] = id;
+    {
+      const int64_t t_draft_start_us = ggml_time_us();
+
+      for (int i = 0; i < n_draft; i++) {
+	if (!gpt2_eval(draft, &dkv, params->n_threads, n_past + i, batch + i, 1,
+		       GPT2_LOGITS_LAST, &logits, &mem_per_token))
+	  goto out;
+	gpt_probs_top_k_top_p(fvec_data(&logits), n_vocab,
+			      params->top_k, params->top_p, params->temp, q + (size_t)i*n_vocab);
+	batch[i + 1] = gpt_sample_probs(q + (size_t)i*n_vocab, n_vocab, rng);
+      }
+      t_draft_us += ggml_time_us() - t_draft_start_us;
+    }
+
+    /* Verify. */
+    {
+      const int64_t t_eval_start_us = ggml_time_us();
+
+      if (!gpt2_eval(model, kv, params->n_threads, n_past, batch, n_draft + 1,
+		     GPT2_LOGITS_ALL, &logits, &mem_per_token))
+	goto out;
+      *t_predict_us += ggml_time_us() - t_eval_start_us;
+      n_passes++;
+    }
+
+    {
+      const int64_t t_start_sample_us = ggml_time_us();
+
+      for (n_ok = 0; n_ok < n_draft; n_ok++) {
+	const float *qi = q + (size_t)n_ok*n_vocab;
+	const int32_t x = batch[n_ok + 1];
+	float sum = 0.0f;
+
+	gpt_probs_top_k_top_p(fvec_data(&logits) + (size_t)n_ok*n_vocab, n_vocab,
+			      params->top_k, params->top_p, params->temp, p);
+	if (p[x] >= qi[x] || gpt_rand_uniform(rng)*qi[x] < p[x])
+	  continue;
+
+	for (int v = 0; v < n_vocab; v++) {
+	  p[v] = p[v] > qi[v] ? p[v] - qi[v] : 0.0f;
+	  sum += p[v];
+	}
+	for (int v = 0; v < n_vocab; v++)
+	  p[v] /= sum;
+	id = gpt_sample_probs(p, n_vocab, rng);
+	break;
+      }
+      if (n_ok == n_draft)
+	id = gpt_sample_top_k_top_p(fvec_data(&logits) + (size_t)n_draft*n_vocab, n_vocab,
+				    params->top_k, params->top_p, params->temp, rng);
+      *t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+
+    /* batch[0] and the n_ok drafts accepted are in both memories, but
+       the draft has not evaluated its last draft. Output stops at the
+       first EOS among them. */
+    {
+      int n_out = n_ok + 1;
+
+      for (int i = 0; !params->ignore_eos && i <= n_ok; i++)
+	if (batch[i] == GPT2_EOS) {
+	  n_out = i + 1;
+	  eos = true;
+	  break;
+	}
+      for (int i = 0; i < n_out; i++)
+	vocab_print(vocab, batch[i]);
+
+      n_past += n_out;
+      n_gen += n_out;
+    }
+    n_drafted += n_draft;
+    n_accepted += n_ok;
+
+    if (!eos && n_ok == n_draft
+	&& !gpt2_eval(draft, &dkv, params->n_threads, n_past - 1, batch + n_draft, 1,
+		      GPT2_LOGITS_LAST, &logits, &mem_per_token))
+      goto out;
+
+    if (eos || (!params->ignore_eos && id == GPT2_EOS))
+      break;
+  }
+  if (!eos)
+    vocab_print(vocab, id);
+
+ out:
+  {
+    const int64_t t_us = ggml_time_us() - t_start_us;
+
+    printf("\n%s: drafted %d, accepted %d (%d%%), %d tokens in %d passes, %ld tokens/s, draft time = %ld us\n",
+	   __func__, n_drafted, n_accepted, n_drafted ? 100*n_accepted/n_drafted : 0,
+	   n_gen, n_passes, t_us ? n_gen*1000000L/t_us : 0, t_draft_us);
+  }
+  gpt2_kv_free(&dkv);
+  fvec_free(&logits);
+  free(batch);
+  free(q);
+  free(p);
+  return n_gen;
+}
@@ -0,0 +1,415 @@
+/*
+  Dependency driven graph execution.
+
+  ggml_graph_compute() runs the nodes of a graph in order and all
+  threads meet at a barrier after each of them, even when the node
+  has a single task and the next one does not use its result. In
+  decode the nodes are small and most of them are single task, so the
+  threads spend much of a token at these barriers.
+
+  Here a node is dispatched to whichever CPU is idle as soon as the
+  nodes it depends on are done. Dependencies are found from the memory
+  that the nodes read and write, since the graph allocator reuses
+  memory between tensors that are not live at the same time. Custom
+  ops (the GEMV kernels) are split in tasks run by any of the CPUs,
+  every other node runs on one CPU as a graph of its own.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nux/nux.h>
+#include <nuxcompute.h>
+#include "ggml.h"
+#include "cgpt-exec.h"
+#include "cgpt-ggml.h"
+#define NUXPERF_DECLARE
+#include "cgpt-perf.h"
+
+#define GPT2_EXEC_MAX_WORKERS 64
+
+/*
+  The custom ops made by gpt2_exec_custom3(), never freed: there is one
+  per kernel and weight shard. The tensor of an op points to its entry
+  in 'extra', which the CPU backend does not use.
+*/
+#define GPT2_EXEC_MAX_OPS 256
+
+struct gpt2_exec_op {
+  ggml_custom3_op_t fun;
+  int n_tasks;
+  void *userdata;
+};
+
+static lock_t gpt2_exec_ops_lock;
+static struct gpt2_exec_op gpt2_exec_ops[GPT2_EXEC_MAX_OPS];
+static int gpt2_exec_n_ops;
+
+struct gpt2_exec_range {
+  uintptr_t start;
+  uintptr_t end;
+};
+
+struct gpt2_exec_node {
+  struct ggml_tensor *t;
+  const struct gpt2_exec_op *op; // tasks run here, if not NULL
+  struct gpt2_exec_range w;
+  struct gpt2_exec_range r[GGML_MAX_SRC];
+  int n_r;
+
+  int n_tasks;
+  int next_task; // tasks handed out
+  int n_done; // tasks finished
+  int n_wait; // producers not done
+
+  // bit k: node i + 1 + k depends on this one
+  uint64_t succ;
+};
+
+struct gpt2_exec;
+
+struct gpt2_exec_worker {
+  struct gpt2_exec *ex;
+  struct ggml_cgraph *gf;
+  void *work;
+  size_t work_size;
+  int64_t t_idle_us;
+  bool done;
+};
+
+/*
+  The executor state is kept between graphs: the node array and the
+  worker work buffers only grow, the worker graphs are made once.
+*/
+struct gpt2_exec {
+  lock_t lock;
+  struct gpt2_exec_node *nodes;
+  int n_nodes;
+  int max_nodes;
+  int window;
+  int nth;
+
+  // all nodes before this one are done
+  int n_done;
+  // bumped when a node is done
+  unsigned gen;
+
+  size_t work_size;
+  // idle time of all computes so far
+  int64_t t_idle_us;
+  struct ggml_context *ctx;
+  struct gpt2_exec_worker workers[GPT2_EXEC_MAX_WORKERS];
+};
+
+static bool
+gpt2_exec_overlap(const struct gpt2_exec_range *a, const struct gpt2_exec_range *b)
+{
+  return a->start < b->end && b->start < a->end;
+}
+
+static bool
+gpt2_exec_depends(const struct gpt2_exec_node *prod, const struct gpt2_exec_node *cons)
+{
+  if (gpt2_exec_overlap(&prod->w, &cons->w))
+    return true;
+  for (int k = 0; k < cons->n_r; k++)
+    if (gpt2_exec_overlap(&prod->w, cons->r + k))
+      return true;
+  for (int k = 0; k < prod->n_r; k++)
+    if (gpt2_exec_overlap(prod->r + k, &cons->w))
+      return true;
+  return false;
+}
+
+static struct gpt2_exec_range
+gpt2_exec_range(const struct ggml_tensor *t)
+{
+  struct gpt2_exec_range r;
+
+  r.start = (uintptr_t)t->data;
+  r.end = r.start + ggml_nbytes(t);
+  return r;
+}
+
+static bool
+gpt2_exec_noop(const struct ggml_tensor *t)
+{
+  switch (t->op) {
+  case GGML_OP_NONE:
+  case GGML_OP_VIEW:
+  case GGML_OP_RESHAPE:
+  case GGML_OP_PERMUTE:
+  case GGML_OP_TRANSPOSE:
+    return true;
+  default:
+    return ggml_nelements(t) == 0;
+  }
+}
+
+/*
+  Fill ex->nodes with the nodes of 'gf' that compute something, and
+  link each of them to the nodes in the window after it that depend
+  on it.
+*/
+static int
+gpt2_exec_link(struct gpt2_exec *ex, struct ggml_cgraph *gf)
+{
+  const int n = ggml_graph_n_nodes(gf);
+  int n_nodes = 0;
+
+  for (int i = 0; i < n; i++) {
+    struct ggml_tensor *t = ggml_graph_node(gf, i);
+    struct gpt2_exec_node *nd = ex->nodes + n_nodes;
+
+    if (gpt2_exec_noop(t))
+      continue;
+
+    memset(nd, 0, sizeof(*nd));
+    nd->t = t;
+    nd->w = gpt2_exec_range(t);
+    for (int k = 0; k < GGML_MAX_SRC; k++)
+      if (t->src[k] != NULL && t->src[k]->data != NULL)
+	nd->r[nd->n_r++] = gpt2_exec_range(t->src[k]);
+
+    nd->n_tasks = 1;
+    if (t->op == GGML_OP_MAP_CUSTOM3 && t->extra != NULL) {
+      nd->op = t->extra;
+      nd->n_tasks = nd->op->n_tasks == GGML_N_TASKS_MAX || nd->op->n_tasks > ex->nth
+	? ex->nth : nd->op->n_tasks;
+    }
+
+    for (int j = n_nodes - 1; j >= 0 && j > n_nodes - ex->window; j--)
+      if (gpt2_exec_depends(ex->nodes + j, nd)) {
+	ex->nodes[j].succ |= 1ULL << (n_nodes - j - 1);
+	nd->n_wait++;
+      }
+    n_nodes++;
+  }
+
+  return n_nodes;
+}
+
+/*
+  A task of a node whose producers are done, among the 'window'
+  nodes after the first that is not done. Called with ex->lock held.
+*/
+static struct gpt2_exec_node *
+gpt2_exec_claim(struct gpt2_exec *ex, int *ith)
+{
+  const int end = ex->n_done + ex->window < ex->n_nodes ? ex->n_done + ex->window : ex->n_nodes;
+
+  for (int i = ex->n_done; i < end; i++) {
+    struct gpt2_exec_node *nd = ex->nodes + i;
+
+    if (nd->n_wait == 0 && nd->next_task < nd->n_tasks) {
+      *ith = nd->next_task++;
+      return nd;
+    }
+  }
+  return NULL;
+}
+
+/* Called with ex->lock held. */
+static void
+gpt2_exec_finish(struct gpt2_exec *ex, struct gpt2_exec_node *nd)
+{
+  const int i = nd - ex->nodes;
+
+  if (++nd->n_done < nd->n_tasks)
+    return;
+
+  for (uint64_t succ = nd->succ; succ; succ &= succ - 1)
+    ex->nodes[i + 1 + __builtin_ctzll(succ)].n_wait--;
+
+  while (ex->n_done < ex->n_nodes && ex->nodes[ex->n_done].n_done == ex->nodes[ex->n_done].n_tasks)
+    ex->n_done++;
+  __atomic_add_fetch(&ex->gen, 1, __ATOMIC_RELEASE);
+}
+
+static void
+gpt2_exec_task(struct gpt2_exec_worker *wk, struct gpt2_exec_node *nd, int ith)
+{
+  struct ggml_tensor *t = nd->t;
+  struct ggml_cplan cplan;
+
+  if (nd->op != NULL) {
+    nd->op->fun(t, t->src[0], t->src[1], t->src[2], ith, nd->n_tasks, nd->op->userdata);
+    return;
+  }
+
+  ggml_graph_clear(wk->gf);
+  ggml_graph_add_node(wk->gf, t);
+  cplan = gpt2_ggml_graph_plan(wk->gf, 1);
+  GGML_ASSERT(cplan.work_size <= wk->ex->work_size);
+  cplan.work_data = wk->work;
+  gpt2_ggml_graph_compute(wk->gf, &cplan);
+}
+
+static void
+gpt2_exec_run(void *arg)
+{
+  struct gpt2_exec_worker *wk = arg;
+  struct gpt2_exec *ex = wk->ex;
+
+  for (;;) {
+    const int64_t t_start_us = ggml_time_us();
+    struct gpt2_exec_node *nd;
+    unsigned gen;
+    int ith;
+
+    spinlock(&ex->lock);
+    while ((nd = gpt2_exec_claim(ex, &ith)) == NULL && ex->n_done < ex->n_nodes) {
+      gen = __atomic_load_n(&ex->gen, __ATOMIC_ACQUIRE);
+      spinunlock(&ex->lock);
+      while (__atomic_load_n(&ex->gen, __ATOMIC_ACQUIRE) == gen)
+	hal_cpu_relax();
+      spinlock(&ex->lock);
+    }
+    spinunlock(&ex->lock);
+    wk->t_idle_us += ggml_time_us() - t_start_us;
+    if (nd == NULL)
+      break;
+
+    gpt2_exec_task(wk, nd, ith);
+
+    spinlock(&ex->lock);
+    gpt2_exec_finish(ex, nd);
+    spinunlock(&ex->lock);
+  }
+
+  __atomic_store_n(&wk->done, true, __ATOMIC_RELEASE);
+}
+
+struct ggml_tensor *
+gpt2_exec_custom3(struct ggml_context *ctx, struct ggml_tensor *a, struct ggml_tensor *b,
+		  struct ggml_tensor *c, ggml_custom3_op_t fun, int n_tasks, void *userdata)
+{
+  struct ggml_tensor *t = ggml_map_custom3(ctx, a, b, c, fun, n_tasks, userdata);
+  struct gpt2_exec_op *op = NULL;
+
+  spinlock(&gpt2_exec_ops_lock);
+  for (int i = 0; i < gpt2_exec_n_ops && op == NULL; i++)
+    if (gpt2_exec_ops[i].fun == fun && gpt2_exec_ops[i].n_tasks == n_tasks
+	&& gpt2_exec_ops[i].userdata == userdata)
+      op = gpt2_exec_ops + i;
+  if (op == NULL && gpt2_exec_n_ops < GPT2_EXEC_MAX_OPS) {
+    op = gpt2_exec_ops + gpt2_exec_n_ops++;
+    op->fun = fun;
+    op->n_tasks = n_tasks;
+    op->userdata = userdata;
+  }
+  spinunlock(&gpt2_exec_ops_lock);
+
+  t->extra = op;
+  return t;
+}
+
+struct gpt2_exec *
+gpt2_exec_new(void)
+{
+  struct ggml_init_params params = {
+    /*.mem_size   =*/ GPT2_EXEC_MAX_WORKERS * ggml_graph_overhead_custom(1, false),
+    /*.mem_buffer =*/ NULL,
+    /*.no_alloc   =*/ true,
+  };
+  struct gpt2_exec *ex;
+
+  ex = calloc(1, sizeof(*ex));
+  if (ex == NULL)
+    return NULL;
+  spinlock_init(&ex->lock);
+
+  ex->ctx = ggml_init(params);
+  if (ex->ctx == NULL) {
+    free(ex);
+    return NULL;
+  }
+  for (int w = 0; w < GPT2_EXEC_MAX_WORKERS; w++) {
+    ex->workers[w].ex = ex;
+    ex->workers[w].gf = ggml_new_graph_custom(ex->ctx, 1, false);
+  }
+  return ex;
+}
+
+void
+gpt2_exec_free(struct gpt2_exec *ex)
+{
+  if (ex == NULL)
+    return;
+
+  for (int w = 0; w < GPT2_EXEC_MAX_WORKERS; w++)
+    free(ex->workers[w].work);
+  ggml_free(ex->ctx);
+  free(ex->nodes);
+  free(ex);
+}
+
+bool
+gpt2_exec_compute(struct gpt2_exec *ex, struct ggml_cgraph *gf, int n_threads, int window)
+{
+  const int n = ggml_graph_n_nodes(gf);
+  unsigned cpu[GPT2_EXEC_MAX_WORKERS];
+  int64_t t_idle_us = 0;
+
+  if (n_threads > GPT2_EXEC_MAX_WORKERS)
+    n_threads = GPT2_EXEC_MAX_WORKERS;
+  if (window > GPT2_EXEC_MAX_WINDOW)
+    window = GPT2_EXEC_MAX_WINDOW;
+
+  if (n > ex->max_nodes) {
+    struct gpt2_exec_node *nodes = realloc(ex->nodes, n * sizeof(*ex->nodes));
+
+    if (nodes == NULL)
+      return false;
+    ex->nodes = nodes;
+    ex->max_nodes = n;
+  }
+
+  ex->window = window < 1 ? 1 : window;
+  ex->nth = n_threads < 1 ? 1 : n_threads;
+  ex->n_done = 0;
+  ex->gen = 0;
+  ex->n_nodes = gpt2_exec_link(ex, gf);
+  ex->work_size = gpt2_ggml_graph_plan(gf, 1).work_size;
+
+  for (int w = 0; w < ex->nth; w++) {
+    struct gpt2_exec_worker *wk = ex->workers + w;
+
+    if (ex->work_size > wk->work_size) {
+      free(wk->work);
+      wk->work_size = 0;
+      if (posix_memalign(&wk->work, 64, ex->work_size)) {
+	wk->work = NULL;
+	fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, ex->work_size);
+	return false;
+      }
+      wk->work_size = ex->work_size;
+    }
+    wk->t_idle_us = 0;
+    wk->done = false;
+  }
+
+  for (int w = 1; w < ex->nth; w++)
+    cpu[w] = nuxcompute_allocate_cpu(gpt2_exec_run, ex->workers + w);
+  gpt2_exec_run(ex->workers);
+
+  for (int w = 1; w < ex->nth; w++) {
+    if (cpu[w] == CPU_INVALID)
+      continue;
+    nuxcompute_wait_cpu(cpu[w]);
+    while (!__atomic_load_n(&ex->workers[w].done, __ATOMIC_ACQUIRE))
+      hal_cpu_relax();
+  }
+
+  for (int w = 0; w < ex->nth; w++)
+    t_idle_us += ex->workers[w].t_idle_us;
+  nuxmeasure_add(&gpt2_exec_idle_us, t_idle_us);
+  ex->t_idle_us += t_idle_us;
+  return true;
+}
+
+int64_t
+gpt2_exec_idle_total(const struct gpt2_exec *ex)
+{
+  return ex == NULL ? 0 : ex->t_idle_us;
+}
@@ -0,0 +1,49 @@
+#ifndef _CGPT_EXEC_H
+#define _CGPT_EXEC_H
+
+#include <stdbool.h>
+#include "ggml.h"
+
+#define GPT2_EXEC_MAX_WINDOW 64
+
+/*
+  ggml_map_custom3(), with the op recorded where gpt2_exec_compute()
+  finds it to split it in tasks over its CPUs. Custom ops made with
+  ggml_map_custom3() directly run on one CPU.
+*/
+struct ggml_tensor *gpt2_exec_custom3(struct ggml_context *ctx, struct ggml_tensor *a,
+				      struct ggml_tensor *b, struct ggml_tensor *c,
+				      ggml_custom3_op_t fun, int n_tasks, void *userdata);
+
+/*
+  Executor state, reused by every graph computed with it.
+*/
+struct gpt2_exec;
+
+struct gpt2_exec *gpt2_exec_new(void);
+void gpt2_exec_free(struct gpt2_exec *ex);
+
+/*
+  Compute 'gf' on the calling CPU and up to n_threads - 1 CPUs of the
+  compute pool, without a barrier between nodes.
+
+  A node starts as soon as the nodes before it that write memory it
+  reads or writes, or read memory it writes, are done. Only the
+  'window' nodes before a node are checked, and a node never starts
+  before all nodes more than 'window' places before it are done. With
+  a window of 1 the nodes run one after the other, as in
+  ggml_graph_compute().
+
+  The time the CPUs spend waiting for a node to become ready is added
+  to gpt2_exec_idle_us.
+*/
+bool gpt2_exec_compute(struct gpt2_exec *ex, struct ggml_cgraph *gf, int n_threads,
+		       int window);
+
+/*
+  Microseconds the CPUs of 'ex' have spent waiting over all its
+  computes so far (0 if 'ex' is NULL).
+*/
+int64_t gpt2_exec_idle_total(const struct gpt2_exec *ex);
+
+#endif
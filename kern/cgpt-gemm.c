@@ -0,0 +1,123 @@
+/*
+  Prefill matrix products on BLIS.
+
+  BLIS is built without threading (contrib/blis configured with
+  --disable-system). The product is a custom op instead, and each of
+  the ggml threads, that run on the compute pool, calls a single
+  threaded bli_sgemm() on its own block of rows of the weight. F16
+  weights are converted GEMM_ROWS rows at a time into a buffer of the
+  thread, allocated by gpt2_gemm_init().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <blis.h>
+#include "ggml.h"
+#include "cgpt-gemm.h"
+#include "cgpt-exec.h"
+
+#define GEMM_ROWS 32
+
+// F16 conversion buffers of GEMM_ROWS*gemm_k floats, one per thread
+static float **gemm_buf;
+static int gemm_nth;
+static int gemm_k;
+
+static void
+gemm_op(struct ggml_tensor *dst, const struct ggml_tensor *a, const struct ggml_tensor *w,
+	const struct ggml_tensor *x, int ith, int nth, void *userdata)
+{
+  const int K = w->ne[0];
+  const int M = w->ne[1];
+  const int N = x->ne[1];
+  // threads past the buffers have no rows
+  const int n = w->type == GGML_TYPE_F16 && nth > gemm_nth ? gemm_nth : nth;
+  const int dr = (M + n - 1)/n;
+  const int r0 = ith*dr < M ? ith*dr : M;
+  const int r1 = r0 + dr < M ? r0 + dr : M;
+  const float alpha = 1.0f, beta = 0.0f;
+  float *wf;
+
+  (void)a;
+  (void)userdata;
+  if (ith >= n || r0 == r1)
+    return;
+
+  // dst[n][m] = sum_k w[m][k] x[n][k], with A = rows of w, B = x^T
+  if (w->type == GGML_TYPE_F32) {
+    bli_sgemm(BLIS_NO_TRANSPOSE, BLIS_NO_TRANSPOSE, r1 - r0, N, K,
+	      &alpha, (float *)((char *)w->data + r0*w->nb[1]), w->nb[1]/sizeof(float), 1,
+	      (float *)x->data, 1, x->nb[1]/sizeof(float),
+	      &beta, (float *)dst->data + r0, 1, dst->nb[1]/sizeof(float));
+    return;
+  }
+
+  wf = gemm_buf[ith];
+  for (int i0 = r0; i0 < r1; i0 += GEMM_ROWS) {
+    const int ni = i0 + GEMM_ROWS < r1 ? GEMM_ROWS : r1 - i0;
+
+    for (int i = 0; i < ni; i++)
+      ggml_fp16_to_fp32_row((const ggml_fp16_t *)((char *)w->data + (i0 + i)*w->nb[1]),
+			    wf + (size_t)i*K, K);
+    bli_sgemm(BLIS_NO_TRANSPOSE, BLIS_NO_TRANSPOSE, ni, N, K,
+	      &alpha, wf, K, 1,
+	      (float *)x->data, 1, x->nb[1]/sizeof(float),
+	      &beta, (float *)dst->data + i0, 1, dst->nb[1]/sizeof(float));
+  }
+}
+
+struct ggml_tensor *
+gpt2_gemm(struct ggml_context *ctx, struct ggml_tensor *w, struct ggml_tensor *x)
+{
+  // rows may be apart, as in a view of some columns of a weight
+  if ((w->type != GGML_TYPE_F32 && w->type != GGML_TYPE_F16) || w->nb[0] != ggml_type_size(w->type)
+      || w->ne[2] != 1 || w->ne[3] != 1)
+    return NULL;
+  if (x->type != GGML_TYPE_F32 || x->nb[0] != sizeof(float) || x->ne[0] != w->ne[0]
+      || x->ne[2] != 1 || x->ne[3] != 1)
+    return NULL;
+  if (w->type == GGML_TYPE_F16 && (gemm_nth == 0 || w->ne[0] > gemm_k))
+    return NULL;
+
+  // [M, N] - shape of the result
+  struct ggml_tensor * y = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, w->ne[1], x->ne[1]);
+
+  return gpt2_exec_custom3(ctx, y, w, x, gemm_op, GGML_N_TASKS_MAX, NULL);
+}
+
+bool
+gpt2_gemm_init(int n_threads, int max_k)
+{
+  float **buf;
+
+  bli_init();
+  if (n_threads <= gemm_nth && max_k <= gemm_k)
+    return true;
+  if (n_threads < gemm_nth)
+    n_threads = gemm_nth;
+  if (max_k < gemm_k)
+    max_k = gemm_k;
+
+  buf = calloc(n_threads, sizeof(*buf));
+  if (buf == NULL)
+    return false;
+  for (int i = 0; i < n_threads; i++) {
+    buf[i] = malloc((size_t)GEMM_ROWS*max_k*sizeof(float));
+    if (buf[i] == NULL) {
+      while (i-- > 0)
+	free(buf[i]);
+      free(buf);
+      return false;
+    }
+  }
+
+  for (int i = 0; i < gemm_nth; i++)
+    free(gemm_buf[i]);
+  free(gemm_buf);
+  gemm_buf = buf;
+  gemm_nth = n_threads;
+  gemm_k = max_k;
+  return true;
+}
@@ -0,0 +1,24 @@
+#ifndef _CGPT_GEMM_H
+#define _CGPT_GEMM_H
+
+#include <stdbool.h>
+#include "ggml.h"
+
+/*
+  Matrix products of a weight 'w' and a batch 'x' of F32 activations
+  by BLIS sgemm, for prefill. NULL if 'w' is not F32 or F16, if 'w'
+  is F16 with more columns than gpt2_gemm_init() allowed for, or if 'x'
+  is not a batch of rows; the caller then uses ggml_mul_mat().
+*/
+struct ggml_tensor *gpt2_gemm(struct ggml_context *ctx, struct ggml_tensor *w,
+			      struct ggml_tensor *x);
+
+/*
+  Initialize BLIS and allocate the F16 conversion buffers of
+  'n_threads' threads for weights of up to 'max_k' columns, before any
+  graph uses gpt2_gemm(). Calling it again only grows the buffers, and
+  not while a graph runs. False if the buffers cannot be allocated.
+*/
+bool gpt2_gemm_init(int n_threads, int max_k);
+
+#endif
@@ -0,0 +1,764 @@
+/*
+  Shape specialized matrix-vector products.
+
+  In decode every weight product is a GEMV with the shapes of the
+  model, and ggml runs it through its generic mul_mat, which converts
+  the activations and calls a vec_dot per output row. These kernels
+  are compiled once per weight type and shape: the reduction length is
+  a constant, the loop fully unrolls, GEMV_ROWS rows share each load
+  of 'x', every row keeps two vector accumulators, and the weight rows
+  are prefetched GEMV_PREFETCH bytes ahead. Weights of other shapes,
+  such as the blocks of rows or columns of the tensor-parallel mode,
+  use a kernel of the same type with the row length a variable.
+
+  Every kernel is also compiled for AVX and for AVX2 with FMA and
+  F16C, and gpt2_gemv_select() picks the variant the CPU runs at boot,
+  so the kernel itself is built for the baseline x86-64 ISA. The
+  kernels are bound by memory bandwidth, AVX-512 does not help them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <nux/nux.h>
+#include <nuxcompute.h>
+#include "ggml.h"
+#include "cgpt-gemv.h"
+#include "cgpt-gemm.h"
+#include "cgpt-ggml.h"
+#include "cgpt-exec.h"
+#define NUXPERF_DECLARE
+#include "cgpt-perf.h"
+
+#define GEMV_ROWS 4
+#define GEMV_PREFETCH 512
+
+typedef float gemv_v8 __attribute__((vector_size(32)));
+typedef uint32_t gemv_v8u __attribute__((vector_size(32)));
+typedef uint16_t gemv_v8h __attribute__((vector_size(16)));
+
+/*
+  The helpers below are always inlined into the kernels, which are
+  compiled for their own ISA. Vectors are passed by address: a 32 byte
+  vector argument or return value has a different ABI with and
+  without AVX.
+*/
+static inline __attribute__((always_inline)) void
+gemv_load_f32(gemv_v8 *v, const float *p)
+{
+  memcpy(v, p, sizeof(*v));
+}
+
+/*
+  Eight halves to floats, without F16C: the exponent and mantissa
+  shifted into place read as a float 2^112 too small, denormals
+  included. Weights have no infinities or NaNs.
+*/
+static inline __attribute__((always_inline)) void
+gemv_load_f16(gemv_v8 *v, const ggml_fp16_t *p)
+{
+  gemv_v8h h;
+  gemv_v8u u;
+
+  memcpy(&h, p, sizeof(h));
+  u = __builtin_convertvector(h, gemv_v8u);
+  *v = (gemv_v8)((gemv_v8u)((gemv_v8)((u & 0x7fff) << 13) * 0x1p112f) | ((u & 0x8000) << 16));
+}
+
+#ifdef __x86_64__
+typedef short gemv_v8s __attribute__((vector_size(16)));
+
+static inline __attribute__((always_inline, target("avx,f16c"))) void
+gemv_load_f16c(gemv_v8 *v, const ggml_fp16_t *p)
+{
+  gemv_v8s h;
+
+  memcpy(&h, p, sizeof(h));
+  *v = __builtin_ia32_vcvtph2ps256(h);
+}
+#endif
+
+typedef void (*gemv_load_f16_fn)(gemv_v8 *v, const ggml_fp16_t *p);
+
+static inline __attribute__((always_inline)) void
+gemv_load(gemv_v8 *v, const enum ggml_type type, const gemv_load_f16_fn load_f16,
+	  const void *w, const int k)
+{
+  if (type == GGML_TYPE_F16)
+    load_f16(v, (const ggml_fp16_t *)w + k);
+  else
+    gemv_load_f32(v, (const float *)w + k);
+}
+
+static inline __attribute__((always_inline)) float
+gemv_hsum(const gemv_v8 *v)
+{
+  return (((*v)[0] + (*v)[4]) + ((*v)[1] + (*v)[5])) + (((*v)[2] + (*v)[6]) + ((*v)[3] + (*v)[7]));
+}
+
+/*
+  y[r0..r1) = w[r0..r1) * x, for rows of 'K' elements of 'type', 'rs'
+  bytes apart. Always inlined, so that every caller gets its own copy
+  compiled for constant 'type', 'K' and F16 loader, and for the ISA of
+  the caller. K is a multiple of 16.
+*/
+static inline __attribute__((always_inline)) void
+gemv_rows(const enum ggml_type type, const int K, const gemv_load_f16_fn load_f16,
+	  float *y, const char *w, const size_t rs, const float *x, const int r0, const int r1)
+{
+  const size_t es = type == GGML_TYPE_F16 ? sizeof(ggml_fp16_t) : sizeof(float);
+  int r = r0;
+
+  for (; r + GEMV_ROWS <= r1; r += GEMV_ROWS) {
+    gemv_v8 acc[GEMV_ROWS][2];
+
+    memset(acc, 0, sizeof(acc));
+    for (int k = 0; k < K; k += 16) {
+      gemv_v8 x0, x1, w0, w1;
+
+      gemv_load_f32(&x0, x + k);
+      gemv_load_f32(&x1, x + k + 8);
+      for (int i = 0; i < GEMV_ROWS; i++) {
+	const char *wr = w + (size_t)(r + i)*rs;
+
+	__builtin_prefetch(wr + k*es + GEMV_PREFETCH, 0, 0);
+	gemv_load(&w0, type, load_f16, wr, k);
+	gemv_load(&w1, type, load_f16, wr, k + 8);
+	acc[i][0] += w0 * x0;
+	acc[i][1] += w1 * x1;
+      }
+    }
+    for (int i = 0; i < GEMV_ROWS; i++) {
+      const gemv_v8 sum = acc[i][0] + acc[i][1];
+
+      y[r + i] = gemv_hsum(&sum);
+    }
+  }
+
+  for (; r < r1; r++) {
+    const char *wr = w + (size_t)r*rs;
+    gemv_v8 acc[2];
+
+    gemv_v8 sum;
+
+    memset(acc, 0, sizeof(acc));
+    for (int k = 0; k < K; k += 16) {
+      gemv_v8 x0, x1, w0, w1;
+
+      gemv_load_f32(&x0, x + k);
+      gemv_load_f32(&x1, x + k + 8);
+      gemv_load(&w0, type, load_f16, wr, k);
+      gemv_load(&w1, type, load_f16, wr, k + 8);
+      acc[0] += w0 * x0;
+      acc[1] += w1 * x1;
+    }
+    sum = acc[0] + acc[1];
+    y[r] = gemv_hsum(&sum);
+  }
+}
+
+typedef void (*gemv_fn)(float *y, const void *w, size_t rs, const float *x, int K, int r0, int r1);
+
+/*
+  One kernel per ISA variant, weight type and shape [K, M], and one per
+  ISA variant and weight type for any K, a multiple of 16.
+*/
+#define GEMV_TARGET_base
+#define GEMV_LOAD_F16_base gemv_load_f16
+#define GEMV_TARGET_avx __attribute__((target("avx")))
+#define GEMV_LOAD_F16_avx gemv_load_f16
+#define GEMV_TARGET_avx2 __attribute__((target("avx2,fma,f16c")))
+#define GEMV_LOAD_F16_avx2 gemv_load_f16c
+
+#define GEMV_DEFINE(_v, _t, _type, _K, _M)				\
+  static void GEMV_TARGET_##_v						\
+  gemv_##_v##_##_t##_##_K##x##_M(float *y, const void *w, size_t rs, const float *x, int K, \
+				 int r0, int r1)			\
+  {									\
+    (void)K;								\
+    gemv_rows(_type, _K, GEMV_LOAD_F16_##_v, y, w, rs, x, r0, r1);	\
+  }
+
+#define GEMV_DEFINE_ANY(_v, _t, _type)					\
+  static void GEMV_TARGET_##_v						\
+  gemv_##_v##_##_t##_any(float *y, const void *w, size_t rs, const float *x, int K, \
+			 int r0, int r1)				\
+  {									\
+    gemv_rows(_type, K, GEMV_LOAD_F16_##_v, y, w, rs, x, r0, r1);	\
+  }
+
+#define GEMV_SHAPES(_v, _t, _type)		\
+  GEMV_DEFINE(_v, _t, _type, 768, 2304)		\
+  GEMV_DEFINE(_v, _t, _type, 768, 768)		\
+  GEMV_DEFINE(_v, _t, _type, 768, 3072)		\
+  GEMV_DEFINE(_v, _t, _type, 3072, 768)		\
+  GEMV_DEFINE(_v, _t, _type, 768, 50257)	\
+  GEMV_DEFINE_ANY(_v, _t, _type)
+
+#define GEMV_ENTRY(_v, _t, _type, _K, _M) { _type, _K, _M, gemv_##_v##_##_t##_##_K##x##_M }
+#define GEMV_ENTRIES(_v, _t, _type)		\
+  GEMV_ENTRY(_v, _t, _type, 768, 2304),		\
+  GEMV_ENTRY(_v, _t, _type, 768, 768),		\
+  GEMV_ENTRY(_v, _t, _type, 768, 3072),		\
+  GEMV_ENTRY(_v, _t, _type, 3072, 768),		\
+  GEMV_ENTRY(_v, _t, _type, 768, 50257),	\
+  { _type, 0, 0, gemv_##_v##_##_t##_any }
+
+#define GEMV_N_KERNELS 12
+
+struct gemv_kernel {
+  enum ggml_type type;
+  int64_t K; // 0: any
+  int64_t M;
+  gemv_fn fn;
+};
+
+#define GEMV_VARIANT(_v)						\
+  GEMV_SHAPES(_v, f32, GGML_TYPE_F32)					\
+  GEMV_SHAPES(_v, f16, GGML_TYPE_F16)					\
+  static const struct gemv_kernel gemv_kernels_##_v[GEMV_N_KERNELS] = {	\
+    GEMV_ENTRIES(_v, f32, GGML_TYPE_F32),				\
+    GEMV_ENTRIES(_v, f16, GGML_TYPE_F16),				\
+  };
+
+GEMV_VARIANT(base)
+#ifdef __x86_64__
+GEMV_VARIANT(avx)
+GEMV_VARIANT(avx2)
+#endif
+
+/*
+  The nuxcompute_cpu_features() of each ISA, named as the libggml
+  copies in libggml/Makefile.in.
+*/
+#define GEMV_ISA_AVX NUXCOMPUTE_CPU_AVX
+#define GEMV_ISA_AVX2 \
+  (GEMV_ISA_AVX | NUXCOMPUTE_CPU_AVX2 | NUXCOMPUTE_CPU_FMA | NUXCOMPUTE_CPU_F16C)
+#define GEMV_ISA_AVX512 \
+  (GEMV_ISA_AVX2 | NUXCOMPUTE_CPU_AVX512F | NUXCOMPUTE_CPU_AVX512BW | NUXCOMPUTE_CPU_AVX512VL)
+
+static const struct {
+  const char *name;
+  unsigned features;
+} gpt2_isas[] = {
+  { "sse3", 0 },
+  { "avx", GEMV_ISA_AVX },
+  { "avx2", GEMV_ISA_AVX2 },
+  { "avx512", GEMV_ISA_AVX512 },
+};
+
+/*
+  The variants, best first.
+*/
+static const struct gemv_isa {
+  const char *name;
+  unsigned features;
+  const struct gemv_kernel *kernels;
+} gemv_isas[] = {
+#ifdef __x86_64__
+  { "avx2", GEMV_ISA_AVX2, gemv_kernels_avx2 },
+  { "avx", GEMV_ISA_AVX, gemv_kernels_avx },
+  { "sse3", 0, gemv_kernels_base },
+#else
+  { "generic", 0, gemv_kernels_base },
+#endif
+};
+
+#define GEMV_N_ISAS (sizeof(gemv_isas)/sizeof(gemv_isas[0]))
+
+/*
+  Set by gpt2_gemv_select(), the baseline until then, NULL if no
+  variant the CPU runs passed its check.
+*/
+static const struct gemv_isa *gemv_isa = gemv_isas + GEMV_N_ISAS - 1;
+/* The variants that passed their check. */
+static bool gemv_isa_ok[GEMV_N_ISAS];
+
+/*
+  Rows of thread 'ith' of 'nth': a contiguous range, a multiple of
+  GEMV_ROWS. The same for every product with the same 'nth'.
+*/
+static void
+gemv_split(const int M, const int ith, const int nth, int *r0, int *r1)
+{
+  const int dr = ((M + nth - 1)/nth + GEMV_ROWS - 1)/GEMV_ROWS*GEMV_ROWS;
+
+  *r0 = ith*dr < M ? ith*dr : M;
+  *r1 = *r0 + dr < M ? *r0 + dr : M;
+}
+
+/*
+  The kernel for the rows of 'w', which may be a view of some of the
+  rows or columns of a weight: the elements of a row are contiguous,
+  the rows are w->nb[1] bytes apart.
+*/
+static const struct gemv_kernel *
+gemv_find(const struct ggml_tensor *w)
+{
+  const struct gemv_kernel *any = NULL;
+
+  if (gemv_isa == NULL || w->nb[0] != ggml_type_size(w->type) || w->ne[2] != 1 || w->ne[3] != 1)
+    return NULL;
+
+  for (int i = 0; i < GEMV_N_KERNELS; i++) {
+    const struct gemv_kernel *k = gemv_isa->kernels + i;
+
+    if (k->type != w->type)
+      continue;
+    if (k->K == w->ne[0] && k->M == w->ne[1])
+      return k;
+    if (k->K == 0 && w->ne[0] % 16 == 0)
+      any = k;
+  }
+  return any;
+}
+
+/*
+  Weight-stationary shards.
+
+  With a fixed thread count, gemv_split() gives thread 'ith' the same
+  rows of a weight at every token, and the ggml threads are started on
+  the lowest free compute CPUs, so the same CPU keeps reading the same
+  rows. gpt2_shards_init() makes this explicit: every thread copies
+  its rows of every weight into memory it allocates itself, and the
+  products of 'nth' threads read these copies, which stay in the
+  caches of their CPU when the shards fit.
+
+  A thread that runs on another CPU than the one that placed its shard
+  is still correct, and counted in gpt2_shard_migrations.
+*/
+struct gpt2_shard {
+  const struct ggml_tensor *w;
+  const struct gemv_kernel *k;
+  struct gpt2_shards *ss;
+  char *rows[GPT2_SHARD_MAX_THREADS];
+};
+
+struct gpt2_shards {
+  int nth;
+  int n_shards;
+  struct gpt2_shard *shards;
+
+  /* Per thread: where its shards live, and what it read from them. */
+  struct {
+    unsigned cpu;
+    uint64_t bytes;
+    uint64_t us;
+  } cpu[GPT2_SHARD_MAX_THREADS];
+};
+
+/* Bytes of a row of 'w', without the gaps of a view. */
+static size_t
+gemv_row_size(const struct ggml_tensor *w)
+{
+  return w->ne[0]*ggml_type_size(w->type);
+}
+
+/*
+  dst = b * c, 'a' only gives dst its shape.
+*/
+static void
+gemv_op(struct ggml_tensor *dst, const struct ggml_tensor *a, const struct ggml_tensor *b,
+	const struct ggml_tensor *c, int ith, int nth, void *userdata)
+{
+  const struct gemv_kernel *k = userdata;
+  int r0, r1;
+
+  (void)a;
+  gemv_split(b->ne[1], ith, nth, &r0, &r1);
+  k->fn((float *)dst->data, b->data, b->nb[1], (const float *)c->data, b->ne[0], r0, r1);
+}
+
+/*
+  gemv_op() on the shard copies, if the thread count is theirs.
+*/
+static void
+gemv_shard_op(struct ggml_tensor *dst, const struct ggml_tensor *a, const struct ggml_tensor *b,
+	      const struct ggml_tensor *c, int ith, int nth, void *userdata)
+{
+  const struct gpt2_shard *sh = userdata;
+  const struct gemv_kernel *k = sh->k;
+  struct gpt2_shards *ss = sh->ss;
+  int r0, r1;
+
+  if (nth != ss->nth) {
+    gemv_op(dst, a, b, c, ith, nth, (void *)k);
+    return;
+  }
+
+  const int64_t t_start_us = ggml_time_us();
+
+  gemv_split(sh->w->ne[1], ith, nth, &r0, &r1);
+  k->fn((float *)dst->data + r0, sh->rows[ith], gemv_row_size(sh->w), (const float *)c->data,
+	sh->w->ne[0], 0, r1 - r0);
+  ss->cpu[ith].us += ggml_time_us() - t_start_us;
+  ss->cpu[ith].bytes += (r1 - r0)*gemv_row_size(sh->w);
+  if (cpu_id() != ss->cpu[ith].cpu)
+    nuxperf_inc(&gpt2_shard_migrations);
+}
+
+struct ggml_tensor *
+gpt2_mul_mat(struct ggml_context *ctx, struct ggml_tensor *w, struct ggml_tensor *x,
+	     bool gemv, struct gpt2_shards *shards, int gemm_n)
+{
+  const struct gemv_kernel *k;
+  struct ggml_tensor *y;
+
+  if (gemm_n > 0 && x->ne[1] >= gemm_n && (y = gpt2_gemm(ctx, w, x)) != NULL)
+    return y;
+
+  if (!gemv || x->type != GGML_TYPE_F32 || x->ne[1] != 1 || x->ne[2] != 1 || x->ne[3] != 1
+      || !ggml_is_contiguous(x) || (k = gemv_find(w)) == NULL)
+    return ggml_mul_mat(ctx, w, x);
+
+  // [M, 1] - shape of the result
+  y = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, w->ne[1], 1);
+
+  for (int i = 0; shards && i < shards->n_shards; i++)
+    if (shards->shards[i].w == w)
+      return gpt2_exec_custom3(ctx, y, w, x, gemv_shard_op, GGML_N_TASKS_MAX, shards->shards + i);
+
+  return gpt2_exec_custom3(ctx, y, w, x, gemv_op, GGML_N_TASKS_MAX, (void *)k);
+}
+
+/*
+  Run on every thread: copy its rows of every weight.
+*/
+static void
+gemv_place_op(struct ggml_tensor *dst, const struct ggml_tensor *a, int ith, int nth, void *userdata)
+{
+  struct gpt2_shards *ss = userdata;
+
+  (void)dst;
+  (void)a;
+  ss->cpu[ith].cpu = cpu_id();
+  for (int i = 0; i < ss->n_shards; i++) {
+    struct gpt2_shard *sh = ss->shards + i;
+    const size_t rs = gemv_row_size(sh->w);
+    int r0, r1;
+
+    gemv_split(sh->w->ne[1], ith, nth, &r0, &r1);
+    sh->rows[ith] = malloc((r1 - r0)*rs + 1);
+    if (sh->rows[ith])
+      memcpy(sh->rows[ith], (const char *)sh->w->data + r0*rs, (r1 - r0)*rs);
+  }
+}
+
+struct gpt2_shards *
+gpt2_shards_init(struct ggml_tensor **w, int n_w, int nth)
+{
+  struct gpt2_shards *ss;
+  struct ggml_init_params params = {
+    .mem_size = ggml_tensor_overhead()*4 + ggml_graph_overhead() + 1024,
+    .mem_buffer = NULL,
+    .no_alloc = false,
+  };
+  struct ggml_context *ctx;
+
+  if (nth < 1 || nth > GPT2_SHARD_MAX_THREADS)
+    return NULL;
+
+  ss = calloc(1, sizeof(*ss));
+  if (ss == NULL)
+    return NULL;
+  ss->nth = nth;
+  ss->shards = calloc(n_w, sizeof(*ss->shards));
+  if (ss->shards == NULL) {
+    free(ss);
+    return NULL;
+  }
+  for (int i = 0; i < n_w; i++) {
+    const struct gemv_kernel *k = gemv_find(w[i]);
+
+    // rows copied in one block
+    if (k == NULL || !ggml_is_contiguous(w[i]))
+      continue;
+    ss->shards[ss->n_shards].w = w[i];
+    ss->shards[ss->n_shards].k = k;
+    ss->shards[ss->n_shards].ss = ss;
+    ss->n_shards++;
+  }
+
+  ctx = ggml_init(params);
+  if (ctx == NULL) {
+    gpt2_shards_free(ss);
+    return NULL;
+  }
+
+  // one task per thread, started the way every decode graph starts them
+  struct ggml_tensor * t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
+  struct ggml_cgraph * gf = ggml_new_graph(ctx);
+  struct ggml_cplan cplan;
+
+  ggml_build_forward_expand(gf, ggml_map_custom1(ctx, t, gemv_place_op, nth, ss));
+  cplan = gpt2_ggml_graph_plan(gf, nth);
+  cplan.work_data = cplan.work_size ? malloc(cplan.work_size) : NULL;
+  if ((cplan.work_size && cplan.work_data == NULL)
+      || gpt2_ggml_graph_compute(gf, &cplan) != GGML_STATUS_SUCCESS) {
+    free(cplan.work_data);
+    ggml_free(ctx);
+    gpt2_shards_free(ss);
+    return NULL;
+  }
+  free(cplan.work_data);
+  ggml_free(ctx);
+
+  for (int i = 0; i < ss->n_shards; i++)
+    for (int j = 0; j < nth; j++)
+      if (ss->shards[i].rows[j] == NULL) {
+	gpt2_shards_free(ss);
+	return NULL;
+      }
+  return ss;
+}
+
+void
+gpt2_shards_free(struct gpt2_shards *ss)
+{
+  if (ss == NULL)
+    return;
+
+  for (int i = 0; i < ss->n_shards; i++)
+    for (int j = 0; j < ss->nth; j++)
+      free(ss->shards[i].rows[j]);
+  free(ss->shards);
+  free(ss);
+}
+
+void
+gpt2_shards_report(const struct gpt2_shards *ss)
+{
+  size_t size = 0;
+
+  for (int i = 0; i < ss->n_shards; i++)
+    size += ggml_nbytes(ss->shards[i].w);
+  printf("%s: %d weights, %zu KB per thread\n", __func__, ss->n_shards, size/ss->nth/1024);
+
+  // bytes per microsecond are MB/s
+  for (int j = 0; j < ss->nth; j++)
+    printf("%s: thread %d cpu %u: %lu MB in %lu us, %lu MB/s\n", __func__, j, ss->cpu[j].cpu,
+	   ss->cpu[j].bytes >> 20, ss->cpu[j].us, ss->cpu[j].bytes/(ss->cpu[j].us ? ss->cpu[j].us : 1));
+}
+
+#define GEMV_STREAM_N (1 << 22)
+#define GEMV_BENCH_REPS 20
+
+/*
+  Kernel 'i' of 'isa' over the weights of its shape.
+*/
+static void
+gemv_bench_kernel(const struct gemv_isa *isa, const int i, struct ggml_tensor **w, const int n_w,
+		  const int64_t bw_triad)
+{
+  const struct gemv_kernel *k = isa->kernels + i;
+  int64_t t_best = INT64_MAX;
+  size_t bytes = 0;
+  float *x, *y;
+
+  if (k->K == 0)
+    return;
+
+  // the variants have the same kernels in the same order
+  for (int j = 0; j < n_w; j++)
+    if (gemv_find(w[j]) == gemv_isa->kernels + i)
+      bytes += ggml_nbytes(w[j]);
+  if (bytes == 0)
+    return;
+
+  x = malloc(k->K*sizeof(float));
+  y = malloc(k->M*sizeof(float));
+  for (int j = 0; j < k->K; j++)
+    x[j] = 1.0f/(j + 1);
+
+  // one product with every weight of this shape, the layers
+  // together are larger than the caches
+  for (int rep = 0; rep < GEMV_BENCH_REPS; rep++) {
+    int64_t t0 = ggml_time_us();
+
+    for (int j = 0; j < n_w; j++)
+      if (gemv_find(w[j]) == gemv_isa->kernels + i)
+	k->fn(y, w[j]->data, w[j]->nb[1], x, k->K, 0, k->M);
+    t0 = ggml_time_us() - t0;
+    t_best = t0 < t_best ? t0 : t_best;
+  }
+
+  const int64_t bw = bytes/(t_best ? t_best : 1);
+
+  printf("%s: %-4s %s %4ldx%-5ld %7ld us, %ld MB/s, %ld%% of triad\n", __func__, isa->name,
+	 ggml_type_name(k->type), k->K, k->M, t_best, bw, 100*bw/(bw_triad ? bw_triad : 1));
+
+  free(x);
+  free(y);
+}
+
+/*
+  STREAM copy and triad over arrays much larger than the caches, then
+  the kernel of each shape over all weights 'w' of that shape, best of
+  GEMV_BENCH_REPS runs, for every variant the CPU runs. All single
+  threaded, so the numbers compare.
+*/
+void
+gpt2_gemv_bench(struct ggml_tensor **w, int n_w)
+{
+  const unsigned features = nuxcompute_cpu_features();
+  float *a = malloc(GEMV_STREAM_N*sizeof(float));
+  float *b = malloc(GEMV_STREAM_N*sizeof(float));
+  float *c = malloc(GEMV_STREAM_N*sizeof(float));
+  int64_t t_copy = INT64_MAX, t_triad = INT64_MAX;
+
+  for (int i = 0; i < GEMV_STREAM_N; i++) {
+    a[i] = 1.0f;
+    b[i] = 2.0f;
+    c[i] = 0.0f;
+  }
+
+  for (int rep = 0; rep < GEMV_BENCH_REPS; rep++) {
+    int64_t t0 = ggml_time_us();
+
+    for (int i = 0; i < GEMV_STREAM_N; i++)
+      c[i] = a[i];
+    int64_t t1 = ggml_time_us();
+    for (int i = 0; i < GEMV_STREAM_N; i++)
+      a[i] = b[i] + 3.0f*c[i];
+    int64_t t2 = ggml_time_us();
+
+    // best of, as STREAM reports
+    t_copy = t1 - t0 < t_copy ? t1 - t0 : t_copy;
+    t_triad = t2 - t1 < t_triad ? t2 - t1 : t_triad;
+  }
+
+  // bytes per microsecond are MB/s
+  const int64_t bw_copy = 2*GEMV_STREAM_N*sizeof(float)/(t_copy ? t_copy : 1);
+  const int64_t bw_triad = 3*GEMV_STREAM_N*sizeof(float)/(t_triad ? t_triad : 1);
+
+  printf("%s: STREAM copy %ld MB/s, triad %ld MB/s\n", __func__, bw_copy, bw_triad);
+
+  free(a);
+  free(b);
+  free(c);
+
+  if (gemv_isa == NULL)
+    return;
+
+  for (size_t v = 0; v < GEMV_N_ISAS; v++) {
+    if ((features & gemv_isas[v].features) != gemv_isas[v].features || !gemv_isa_ok[v])
+      continue;
+    for (int i = 0; i < GEMV_N_KERNELS; i++)
+      gemv_bench_kernel(gemv_isas + v, i, w, n_w, bw_triad);
+  }
+}
+
+/* Rows of a checked product: two blocks of GEMV_ROWS and a tail. */
+#define GEMV_CHECK_M (2*GEMV_ROWS + 3)
+/* Row length of the checked any-K kernels, not one of the shapes. */
+#define GEMV_CHECK_K 80
+
+/*
+  Compare kernel 'k' with ggml_mul_mat() on GEMV_CHECK_M rows of a
+  weight of its type and row length, GEMV_CHECK_K and a view of wider
+  rows for the any-K kernels (shape 0x0). F16 products in ggml round
+  'x' to F16, hence the larger tolerance. Returns false if they differ
+  or on failure.
+*/
+static bool
+gemv_check_kernel(const struct gemv_isa *isa, const struct gemv_kernel *k)
+{
+  const int K = k->K ? k->K : GEMV_CHECK_K;
+  const int M = GEMV_CHECK_M;
+  // rows with a gap after them for the any-K kernels
+  const int ld = k->K ? K : K + GEMV_ROWS;
+  struct ggml_init_params params = {
+    .mem_size = (size_t)ld*M*sizeof(float) + (K + M)*sizeof(float)
+    + 8*ggml_tensor_overhead() + ggml_graph_overhead() + 1024,
+    .mem_buffer = NULL,
+    .no_alloc = false,
+  };
+  struct ggml_context *ctx;
+  struct ggml_tensor *wt, *w, *x, *ref;
+  struct ggml_cgraph *gf;
+  struct ggml_cplan cplan;
+  float y[GEMV_CHECK_M];
+  float max_abs = 0.0f, max_diff = 0.0f;
+  bool ok = false;
+
+  ctx = ggml_init(params);
+  if (ctx == NULL)
+    return false;
+
+  wt = ggml_new_tensor_2d(ctx, k->type, ld, M);
+  w = ggml_view_2d(ctx, wt, K, M, wt->nb[1], 0);
+  x = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, K);
+  for (int i = 0; i < ld*M; i++) {
+    const float v = (float)((i*7919 + 13) % 1024)/1024.0f - 0.5f;
+
+    if (k->type == GGML_TYPE_F16)
+      ((ggml_fp16_t *)wt->data)[i] = ggml_fp32_to_fp16(v);
+    else
+      ((float *)wt->data)[i] = v;
+  }
+  for (int j = 0; j < K; j++)
+    ((float *)x->data)[j] = (float)((j*104729 + 7) % 1024)/1024.0f - 0.5f;
+
+  ref = ggml_mul_mat(ctx, w, x);
+  gf = ggml_new_graph(ctx);
+  ggml_build_forward_expand(gf, ref);
+  cplan = gpt2_ggml_graph_plan(gf, 1);
+  cplan.work_data = cplan.work_size ? malloc(cplan.work_size) : NULL;
+  if (cplan.work_size && cplan.work_data == NULL)
+    goto out;
+  if (gpt2_ggml_graph_compute(gf, &cplan) != GGML_STATUS_SUCCESS)
+    goto out;
+
+  k->fn(y, w->data, w->nb[1], (const float *)x->data, K, 0, M);
+
+  for (int i = 0; i < M; i++) {
+    const float r = ((float *)ref->data)[i];
+
+    max_abs = fmaxf(max_abs, fabsf(r));
+    max_diff = fmaxf(max_diff, fabsf(r - y[i]));
+  }
+  ok = max_diff <= (k->type == GGML_TYPE_F16 ? 1e-2f : 1e-4f)*max_abs;
+  printf("%s: %-4s %s %4ldx%-5ld max relative error %ld ppm: %s\n", __func__, isa->name,
+	 ggml_type_name(k->type), (long)k->K, (long)k->M,
+	 (long)(1e6f*max_diff/(max_abs > 0.0f ? max_abs : 1.0f)), ok ? "OK" : "FAILED");
+
+ out:
+  free(cplan.work_data);
+  ggml_free(ctx);
+  return ok;
+}
+
+const char *
+gpt2_gemv_select(unsigned features)
+{
+  for (size_t v = 0; v < GEMV_N_ISAS; v++) {
+    bool ok = true;
+
+    gemv_isa_ok[v] = false;
+    if ((features & gemv_isas[v].features) != gemv_isas[v].features)
+      continue;
+    // check every kernel, even after one failed
+    for (int i = 0; i < GEMV_N_KERNELS; i++)
+      ok = gemv_check_kernel(gemv_isas + v, gemv_isas[v].kernels + i) && ok;
+    gemv_isa_ok[v] = ok;
+  }
+
+  // the best that passed, else gpt2_mul_mat() is ggml_mul_mat()
+  gemv_isa = NULL;
+  for (size_t v = 0; v < GEMV_N_ISAS; v++)
+    if (gemv_isa_ok[v]) {
+      gemv_isa = gemv_isas + v;
+      return gemv_isa->name;
+    }
+  return "none";
+}
+
+int
+gpt2_isa_features(const char *name)
+{
+  for (size_t i = 0; i < sizeof(gpt2_isas)/sizeof(gpt2_isas[0]); i++)
+    if (!strcmp(name, gpt2_isas[i].name))
+      return gpt2_isas[i].features;
+  return -1;
+}
@@ -0,0 +1,56 @@
+#ifndef _CGPT_GEMV_H
+#define _CGPT_GEMV_H
+
+#include <stdbool.h>
+#include "ggml.h"
+
+#define GPT2_SHARD_MAX_THREADS 64
+
+struct gpt2_shards;
+
+/*
+  Matrix-vector products for single token decode.
+
+  gpt2_mul_mat() is ggml_mul_mat() for a weight 'w' and activations
+  'x'. When 'x' is a single F32 column and 'w' has the type and shape
+  of one of the GPT-2 117M matrices, the product is a custom op that
+  runs a kernel compiled for that shape. Other F32 or F16 weights with
+  rows of a multiple of 16 elements, views of blocks of rows or
+  columns included, get the kernel for any row length. Otherwise, or
+  if 'gemv' is false, it is a plain ggml_mul_mat(). If 'shards' holds
+  'w', the kernel reads the shard copies of the threads. Batches of
+  'gemm_n' or more rows use gpt2_gemm(), if 'gemm_n' is not zero.
+*/
+struct ggml_tensor *gpt2_mul_mat(struct ggml_context *ctx, struct ggml_tensor *w,
+				 struct ggml_tensor *x, bool gemv, struct gpt2_shards *shards,
+				 int gemm_n);
+
+/*
+  Per thread copies of the rows that each of 'nth' threads computes,
+  for the weights 'w' that have a kernel. NULL on failure.
+*/
+struct gpt2_shards *gpt2_shards_init(struct ggml_tensor **w, int n_w, int nth);
+void gpt2_shards_free(struct gpt2_shards *ss);
+void gpt2_shards_report(const struct gpt2_shards *ss);
+
+/*
+  Bandwidth of the GEMV kernels on the given weights against STREAM
+  copy and triad, on the calling CPU, for each variant it runs.
+*/
+void gpt2_gemv_bench(struct ggml_tensor **w, int n_w);
+
+/*
+  Check every kernel of every variant the CPU 'features' run, from
+  nuxcompute_cpu_features(), against ggml_mul_mat(), use the best
+  variant that passes and return its name, "none" if none did. Call
+  after gpt2_ggml_select() and before building any graph.
+*/
+const char *gpt2_gemv_select(unsigned features);
+
+/*
+  The nuxcompute_cpu_features() that the ISA 'name' needs ("sse3",
+  "avx", "avx2" or "avx512" on amd64), -1 if unknown.
+*/
+int gpt2_isa_features(const char *name);
+
+#endif
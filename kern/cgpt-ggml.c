@@ -0,0 +1,91 @@
+/*
+  Boot time selection of the ggml kernels.
+
+  Each ISA copy of libggml has its own globals, the FP16 and GELU
+  tables among them, which its ggml_init() fills on the first call:
+  gpt2_ggml_select() makes that call once for the copy it picks. A
+  plan is only valid for the copy that made it, so plans and computes
+  both go through the selected copy.
+*/
+
+#include <stdio.h>
+#include <nux/nux.h>
+#include <nuxcompute.h>
+#include "ggml.h"
+#include "cgpt-ggml.h"
+#include "cgpt-gemv.h"
+
+#define GPT2_GGML_DECLARE(_isa)						\
+  struct ggml_context *_isa##_ggml_init(struct ggml_init_params params); \
+  void _isa##_ggml_free(struct ggml_context *ctx);			\
+  struct ggml_cplan _isa##_ggml_graph_plan(const struct ggml_cgraph *gf, int n_threads); \
+  enum ggml_status _isa##_ggml_graph_compute(struct ggml_cgraph *gf, struct ggml_cplan *cplan);
+
+#define GPT2_GGML_ENTRY(_isa)						\
+  { #_isa, _isa##_ggml_init, _isa##_ggml_free,				\
+    _isa##_ggml_graph_plan, _isa##_ggml_graph_compute }
+
+#ifdef __x86_64__
+GPT2_GGML_DECLARE(avx)
+GPT2_GGML_DECLARE(avx2)
+GPT2_GGML_DECLARE(avx512)
+#endif
+
+static const struct gpt2_ggml {
+  const char *name;
+  struct ggml_context *(*init)(struct ggml_init_params params);
+  void (*free)(struct ggml_context *ctx);
+  struct ggml_cplan (*graph_plan)(const struct ggml_cgraph *gf, int n_threads);
+  enum ggml_status (*graph_compute)(struct ggml_cgraph *gf, struct ggml_cplan *cplan);
+} gpt2_ggmls[] = {
+  /* The best first. */
+#ifdef __x86_64__
+  GPT2_GGML_ENTRY(avx512),
+  GPT2_GGML_ENTRY(avx2),
+  GPT2_GGML_ENTRY(avx),
+  { "sse3", ggml_init, ggml_free, ggml_graph_plan, ggml_graph_compute },
+#else
+  { "base", ggml_init, ggml_free, ggml_graph_plan, ggml_graph_compute },
+#endif
+};
+
+#define GPT2_GGML_N (sizeof(gpt2_ggmls)/sizeof(gpt2_ggmls[0]))
+
+static const struct gpt2_ggml *gpt2_ggml = gpt2_ggmls + GPT2_GGML_N - 1;
+
+const char *
+gpt2_ggml_select(unsigned features)
+{
+  struct ggml_init_params params = {
+    /*.mem_size   =*/ 0,
+    /*.mem_buffer =*/ NULL,
+    /*.no_alloc   =*/ true,
+  };
+  struct ggml_context *ctx;
+
+  for (size_t i = 0; i < GPT2_GGML_N; i++) {
+    const int isa = gpt2_isa_features(gpt2_ggmls[i].name);
+
+    if (isa >= 0 && (features & isa) == (unsigned)isa) {
+      gpt2_ggml = gpt2_ggmls + i;
+      break;
+    }
+  }
+
+  ctx = gpt2_ggml->init(params);
+  if (ctx != NULL)
+    gpt2_ggml->free(ctx);
+  return gpt2_ggml->name;
+}
+
+struct ggml_cplan
+gpt2_ggml_graph_plan(const struct ggml_cgraph *gf, int n_threads)
+{
+  return gpt2_ggml->graph_plan(gf, n_threads);
+}
+
+enum ggml_status
+gpt2_ggml_graph_compute(struct ggml_cgraph *gf, struct ggml_cplan *cplan)
+{
+  return gpt2_ggml->graph_compute(gf, cplan);
+}
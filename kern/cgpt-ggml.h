@@ -0,0 +1,27 @@
+#ifndef _CGPT_GGML_H
+#define _CGPT_GGML_H
+
+#include "ggml.h"
+
+/*
+  Graph planning and compute with the copy of ggml built for the best
+  ISA the CPU runs.
+
+  libggml is built once for the baseline ISA, which builds the graphs
+  and allocates them, and on amd64 once more for each of AVX, AVX2 and
+  AVX-512, with every symbol of the copy prefixed with its ISA (see
+  libggml/Makefile.in). The graph structures are the same in all of
+  them, only the kernels differ.
+*/
+
+/*
+  Use the best copy for the CPU 'features', from
+  nuxcompute_cpu_features(), and return its name. Call before
+  computing any graph.
+*/
+const char *gpt2_ggml_select(unsigned features);
+
+struct ggml_cplan gpt2_ggml_graph_plan(const struct ggml_cgraph *gf, int n_threads);
+enum ggml_status gpt2_ggml_graph_compute(struct ggml_cgraph *gf, struct ggml_cplan *cplan);
+
+#endif
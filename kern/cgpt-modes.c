@@ -0,0 +1,502 @@
+/*
+  Evaluation modes of cgpt-2.c other than generation: scoring of
+  continuations, beam search and embeddings.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ggml.h"
+
+#include "util.h"
+#include "cgpt-common.h"
+#include "cgpt-2.h"
+
+#define NUXPERF_DECLARE
+#include "cgpt-perf.h"
+
+static float
+gpt2_logprob(const float *logits, const int n_vocab, const int32_t id)
+{
+  float max = logits[0];
+  double sum = 0.0;
+
+  for (int i = 1; i < n_vocab; i++)
+    max = logits[i] > max ? logits[i] : max;
+  for (int i = 0; i < n_vocab; i++)
+    sum += expf(logits[i] - max);
+  return logits[id] - max - log(sum);
+}
+
+/*
+  Log-likelihood scoring.
+
+  The context is evaluated once. Continuations are then packed into
+  batches of up to n_batch tokens, each continuation a separate
+  sequence after the shared context rows, and evaluated with logits
+  for every row. The next batch overwrites the rows of the previous
+  one.
+
+  'logprobs' receives log p(token | context, previous tokens) for every
+  token of every continuation, in order.
+*/
+bool gpt2_score(const struct gpt2_model *model,
+		struct gpt2_kv_cache *kv,
+		const struct gpt_params *params,
+		const int32_t *ctx,
+		const int n_ctx_tokens,
+		int32_t **conts,
+		const int *cont_counts,
+		const int n_conts,
+		float *logprobs)
+{
+  const int n_vocab = model->hparams.n_vocab;
+  struct gpt2_scratch scratch;
+  struct fvec logits;
+  size_t mem_per_token = 0;
+  float *ctx_logits;
+  int32_t *tokens, *pos, *seq;
+  int n_max = params->n_batch;
+  bool ok = false;
+
+  if (n_ctx_tokens <= 0)
+    return false;
+
+  for (int c = 0; c < n_conts; c++)
+    n_max = cont_counts[c] - 1 > n_max ? cont_counts[c] - 1 : n_max;
+
+  fvec_init(&logits);
+  memset(&scratch, 0, sizeof(scratch));
+  ctx_logits = malloc(n_vocab*sizeof(float));
+  tokens = malloc(n_max*sizeof(int32_t));
+  pos = malloc(n_max*sizeof(int32_t));
+  seq = malloc(n_max*sizeof(int32_t));
+
+  /* Shared context. */
+  for (int i = 0; i < n_ctx_tokens; i += params->n_batch) {
+    const int n = n_ctx_tokens - i < params->n_batch ? n_ctx_tokens - i : params->n_batch;
+
+    if (!gpt2_eval(model, kv, params->n_threads, i, (int32_t *)ctx + i, n,
+		   GPT2_LOGITS_LAST, &logits, &mem_per_token))
+      goto out;
+  }
+  memcpy(ctx_logits, fvec_data(&logits), n_vocab*sizeof(float));
+
+  if (!gpt2_scratch_init(&scratch))
+    goto out;
+
+  for (int c0 = 0, k = 0; c0 < n_conts; ) {
+    struct gpt2_batch_layout bl = { .pos = pos, .seq = seq };
+    struct gpt2_graph g;
+    int c1, N = 0;
+
+    /* Pack whole continuations. The last token of each is only
+       predicted, never evaluated. */
+    for (c1 = c0; c1 < n_conts; c1++) {
+      const int n = cont_counts[c1] > 0 ? cont_counts[c1] - 1 : 0;
+
+      if (c1 > c0 && N + n > params->n_batch)
+	break;
+      for (int j = 0; j < n; j++, N++) {
+	tokens[N] = conts[c1][j];
+	pos[N] = n_ctx_tokens + j;
+	seq[N] = c1;
+      }
+    }
+
+    if (N > 0) {
+      if (!gpt2_kv_reserve(kv, n_ctx_tokens, n_ctx_tokens + N)
+	  || !gpt2_build_batch(model, kv, &scratch, n_ctx_tokens, N, GPT2_LOGITS_ALL, &bl, &g))
+	goto out;
+
+      memcpy(g.embd->data, tokens, N*sizeof(int32_t));
+      if (!gpt2_compute(model, &g, params->n_threads)) {
+	gpt2_graph_free(&g);
+	goto out;
+      }
+    }
+
+    for (int c = c0, row = 0; c < c1; c++) {
+      for (int j = 0; j < cont_counts[c]; j++) {
+	const float *l = j == 0 ? ctx_logits :
+	  (float *)ggml_get_data(g.logits) + (size_t)(row + j - 1)*n_vocab;
+
+	logprobs[k++] = gpt2_logprob(l, n_vocab, conts[c][j]);
+      }
+      row += cont_counts[c] > 0 ? cont_counts[c] - 1 : 0;
+    }
+
+    if (N > 0)
+      gpt2_graph_free(&g);
+    c0 = c1;
+  }
+  ok = true;
+
+ out:
+  gpt2_scratch_free(&scratch);
+  fvec_free(&logits);
+  free(ctx_logits);
+  free(tokens);
+  free(pos);
+  free(seq);
+  return ok;
+}
+
+/*
+  Beam search.
+
+  All beams live in one KV memory. Every row belongs to the beams whose
+  bit is set in its cell_seq mask, so beams share the rows of their
+  common prefix and a row is only written once: when beams are
+  reselected, a new beam takes over the bits of its parent, and a row
+  whose mask becomes empty is free. Free rows are reclaimed by moving
+  the live ones down when the memory is full.
+
+  Each step evaluates the last token of every unfinished beam in a
+  single batch, each beam a sequence of the batch layout, and keeps
+  the n_beams best extensions by total log-probability. A finished
+  beam competes with its score unchanged.
+*/
+#define GPT2_MAX_BEAMS 64
+
+struct gpt2_beam {
+  int32_t *tokens; /* Generated tokens, the last one not evaluated yet. */
+  int n_tokens;
+  int32_t token; /* Candidates: the token they add to their parent. */
+  float score;
+  bool done;
+};
+
+/*
+  The 'k' largest log-probabilities of a logits row.
+*/
+static void
+gpt2_top_logprobs(const float *logits, const int n_vocab, const int k, int32_t *ids, float *lps)
+{
+  float max = logits[0];
+  double sum = 0.0;
+  float lse;
+  int n = 0;
+
+  for (int i = 1; i < n_vocab; i++)
+    max = logits[i] > max ? logits[i] : max;
+  for (int i = 0; i < n_vocab; i++)
+    sum += expf(logits[i] - max);
+  lse = max + log(sum);
+
+  for (int i = 0; i < n_vocab; i++) {
+    int j;
+
+    if (n == k && logits[i] <= logits[ids[k - 1]])
+      continue;
+    if (n < k)
+      n++;
+    /* Insertion in 'ids', sorted by decreasing logit. */
+    for (j = n - 1; j > 0 && logits[ids[j - 1]] < logits[i]; j--)
+      ids[j] = ids[j - 1];
+    ids[j] = i;
+  }
+  for (int j = 0; j < k; j++)
+    lps[j] = logits[ids[j]] - lse;
+}
+
+/*
+  Move the live rows of the first 'n_used' to the front, keeping their
+  order. Returns the new number of rows used.
+*/
+static int
+gpt2_beam_compact(struct gpt2_kv_cache *kv, uint64_t *cell_seq, const int n_used)
+{
+  void *row = malloc(gpt2_kv_rows_size(kv, 1));
+  int n = 0;
+
+  for (int j = 0; j < n_used; j++) {
+    if (cell_seq[j] == 0)
+      continue;
+    if (j != n) {
+      gpt2_kv_rows(kv, j, 1, row, false);
+      gpt2_kv_rows(kv, n, 1, row, true);
+      cell_seq[n] = cell_seq[j];
+    }
+    n++;
+  }
+  free(row);
+  return n;
+}
+
+/*
+  Beam search of width 'n_beams' for up to 'n_predict' tokens after
+  'prompt'. The best beam is written to 'best', which must hold
+  n_predict tokens; returns its length, or -1 on failure.
+*/
+int gpt2_beam_search(const struct gpt2_model *model,
+		     struct gpt2_kv_cache *kv,
+		     const struct gpt_params *params,
+		     const int32_t *prompt,
+		     const int n_prompt,
+		     const int n_beams,
+		     const int n_predict,
+		     int32_t *best)
+{
+  const int n_vocab = model->hparams.n_vocab;
+  const int n_ctx = kv->n_ctx_max;
+  struct gpt2_beam beams[GPT2_MAX_BEAMS], next[GPT2_MAX_BEAMS];
+  struct gpt2_beam *cand;
+  int *parent;
+  int32_t ids[GPT2_MAX_BEAMS], pos[GPT2_MAX_BEAMS], seq[GPT2_MAX_BEAMS], tokens[GPT2_MAX_BEAMS];
+  float lps[GPT2_MAX_BEAMS];
+  int row_of[GPT2_MAX_BEAMS];
+  uint64_t *cell_seq, *new_seq;
+  struct gpt2_scratch scratch;
+  struct fvec logits;
+  size_t mem_per_token = 0;
+  int n_used = 0, ret = -1;
+
+  if (n_beams < 1 || n_beams > GPT2_MAX_BEAMS || n_prompt <= 0 || n_predict <= 0
+      || n_prompt + n_beams > n_ctx)
+    return -1;
+
+  memset(&scratch, 0, sizeof(scratch));
+  fvec_init(&logits);
+  cand = malloc(n_beams*n_beams*sizeof(*cand));
+  parent = malloc(n_beams*n_beams*sizeof(*parent));
+  cell_seq = calloc(n_ctx, sizeof(uint64_t));
+  new_seq = calloc(n_ctx, sizeof(uint64_t));
+  for (int b = 0; b < n_beams; b++) {
+    beams[b].tokens = malloc(n_predict*sizeof(int32_t));
+    next[b].tokens = malloc(n_predict*sizeof(int32_t));
+  }
+
+  if (!gpt2_scratch_init(&scratch))
+    goto out;
+
+  /* The prompt is shared by every beam. */
+  for (int i = 0; i < n_prompt; i += params->n_batch) {
+    const int n = n_prompt - i < params->n_batch ? n_prompt - i : params->n_batch;
+
+    if (!gpt2_eval(model, kv, params->n_threads, i, (int32_t *)prompt + i, n,
+		   GPT2_LOGITS_LAST, &logits, &mem_per_token))
+      goto out;
+  }
+  for (int j = 0; j < n_prompt; j++)
+    cell_seq[j] = n_beams == 64 ? ~0ULL : (1ULL << n_beams) - 1;
+  n_used = n_prompt;
+
+  gpt2_top_logprobs(fvec_data(&logits), n_vocab, n_beams, ids, lps);
+  for (int b = 0; b < n_beams; b++) {
+    beams[b].tokens[0] = ids[b];
+    beams[b].n_tokens = 1;
+    beams[b].score = lps[b];
+    beams[b].done = ids[b] == GPT2_EOS || n_predict == 1;
+  }
+
+  while (true) {
+    struct gpt2_batch_layout bl = { .pos = pos, .seq = seq, .n_seq = n_beams, .cell_seq = cell_seq };
+    struct gpt2_graph g;
+    int N = 0, n_cand = 0, n_rows = 0, n_live = 0;
+
+    for (int b = 0; b < n_beams; b++) {
+      row_of[b] = -1;
+      if (beams[b].done)
+	continue;
+      row_of[b] = N;
+      tokens[N] = beams[b].tokens[beams[b].n_tokens - 1];
+      pos[N] = n_prompt + beams[b].n_tokens - 1;
+      seq[N] = b;
+      N++;
+    }
+    if (N == 0)
+      break;
+
+    if (n_used + N > n_ctx) {
+      n_used = gpt2_beam_compact(kv, cell_seq, n_used);
+      if (n_used + N > n_ctx)
+	break;
+    }
+
+    if (!gpt2_kv_reserve(kv, n_used, n_used + N)
+	|| !gpt2_build_batch(model, kv, &scratch, n_used, N, GPT2_LOGITS_ALL, &bl, &g))
+      goto out;
+    memcpy(g.embd->data, tokens, N*sizeof(int32_t));
+    if (!gpt2_compute(model, &g, params->n_threads)) {
+      gpt2_graph_free(&g);
+      goto out;
+    }
+
+    /* The rows just written belong to their beam. */
+    for (int i = 0; i < N; i++)
+      cell_seq[n_used + i] = 1ULL << seq[i];
+
+    /* Extensions of every beam. */
+    for (int b = 0; b < n_beams; b++) {
+      if (beams[b].done) {
+	cand[n_cand] = beams[b];
+	parent[n_cand++] = b;
+	continue;
+      }
+      gpt2_top_logprobs((float *)ggml_get_data(g.logits) + (size_t)row_of[b]*n_vocab,
+			n_vocab, n_beams, ids, lps);
+      for (int k = 0; k < n_beams; k++) {
+	cand[n_cand].tokens = NULL;
+	cand[n_cand].n_tokens = 0;
+	cand[n_cand].token = ids[k];
+	cand[n_cand].score = beams[b].score + lps[k];
+	cand[n_cand].done = false;
+	parent[n_cand++] = b;
+      }
+    }
+    gpt2_graph_free(&g);
+    n_used += N;
+
+    /* Keep the n_beams best candidates. */
+    for (int b = 0; b < n_beams; b++) {
+      int m = b;
+
+      for (int c = b + 1; c < n_cand; c++)
+	if (cand[c].score > cand[m].score)
+	  m = c;
+      if (m != b) {
+	struct gpt2_beam t = cand[b];
+	int tp = parent[b];
+
+	cand[b] = cand[m];
+	parent[b] = parent[m];
+	cand[m] = t;
+	parent[m] = tp;
+      }
+    }
+
+    /* New beam b inherits the rows of its parent. */
+    memset(new_seq, 0, n_used*sizeof(uint64_t));
+    for (int b = 0; b < n_beams; b++) {
+      const struct gpt2_beam *p = beams + parent[b];
+
+      for (int j = 0; j < n_used; j++)
+	if ((cell_seq[j] >> parent[b]) & 1)
+	  new_seq[j] |= 1ULL << b;
+
+      memcpy(next[b].tokens, p->tokens, p->n_tokens*sizeof(int32_t));
+      next[b].n_tokens = p->n_tokens;
+      next[b].score = cand[b].score;
+      next[b].done = p->done;
+      if (!p->done) {
+	next[b].tokens[next[b].n_tokens++] = cand[b].token;
+	next[b].done = cand[b].token == GPT2_EOS || next[b].n_tokens >= n_predict;
+      }
+      n_rows += n_prompt + p->n_tokens - p->done;
+    }
+    memcpy(cell_seq, new_seq, n_used*sizeof(uint64_t));
+    for (int j = 0; j < n_used; j++)
+      n_live += cell_seq[j] != 0;
+    for (int b = 0; b < n_beams; b++) {
+      int32_t *t = beams[b].tokens;
+
+      beams[b] = next[b];
+      next[b].tokens = t;
+    }
+    nuxmeasure_add(&gpt2_beam_shared_rows, n_rows - n_live);
+  }
+
+  {
+    int m = 0;
+
+    for (int b = 1; b < n_beams; b++)
+      if (beams[b].score > beams[m].score)
+	m = b;
+    memcpy(best, beams[m].tokens, beams[m].n_tokens*sizeof(int32_t));
+    ret = beams[m].n_tokens;
+  }
+
+ out:
+  for (int b = 0; b < n_beams; b++) {
+    free(beams[b].tokens);
+    free(next[b].tokens);
+  }
+  gpt2_scratch_free(&scratch);
+  fvec_free(&logits);
+  free(cand);
+  free(parent);
+  free(cell_seq);
+  free(new_seq);
+  return ret;
+}
+
+/*
+  Embeddings of 'n_inputs' token sequences, each pooled with 'mode'
+  (GPT2_EMBD_LAST or GPT2_EMBD_MEAN) into n_embd floats of 'out'.
+
+  Inputs are packed into batches of up to n_batch tokens, each its own
+  sequence from position 0, and the graph stops after the final norm.
+*/
+bool gpt2_embed(const struct gpt2_model *model,
+		struct gpt2_kv_cache *kv,
+		const struct gpt_params *params,
+		int32_t **inputs,
+		const int *counts,
+		const int n_inputs,
+		enum gpt2_logits mode,
+		float *out)
+{
+  const int n_embd = model->hparams.n_embd;
+  struct gpt2_scratch scratch;
+  int32_t *tokens, *pos, *seq;
+  int n_max = params->n_batch;
+  bool ok = false;
+
+  for (int i = 0; i < n_inputs; i++)
+    n_max = counts[i] > n_max ? counts[i] : n_max;
+
+  memset(&scratch, 0, sizeof(scratch));
+  tokens = malloc(n_max*sizeof(int32_t));
+  pos = malloc(n_max*sizeof(int32_t));
+  seq = malloc(n_max*sizeof(int32_t));
+
+  if (!gpt2_scratch_init(&scratch))
+    goto out;
+
+  for (int i0 = 0; i0 < n_inputs; ) {
+    struct gpt2_batch_layout bl = { .pos = pos, .seq = seq, .n_seq = 0 };
+    struct gpt2_graph g;
+    int i1, N = 0;
+
+    for (i1 = i0; i1 < n_inputs; i1++) {
+      if (i1 > i0 && N + counts[i1] > params->n_batch)
+	break;
+      for (int j = 0; j < counts[i1]; j++, N++) {
+	tokens[N] = inputs[i1][j];
+	pos[N] = j;
+	seq[N] = i1 - i0;
+      }
+    }
+    bl.n_seq = i1 - i0;
+
+    if (N == 0 || N > kv->n_ctx_max) {
+      fprintf(stderr, "%s: input %d has %d tokens\n", __func__, i0, counts[i0]);
+      goto out;
+    }
+
+    if (!gpt2_kv_reserve(kv, 0, N)
+	|| !gpt2_build_batch(model, kv, &scratch, 0, N, mode, &bl, &g))
+      goto out;
+
+    memcpy(g.embd->data, tokens, N*sizeof(int32_t));
+    if (!gpt2_compute(model, &g, params->n_threads)) {
+      gpt2_graph_free(&g);
+      goto out;
+    }
+
+    // [n_embd, n_seq]
+    memcpy(out + (size_t)i0*n_embd, ggml_get_data(g.logits), (size_t)bl.n_seq*n_embd*sizeof(float));
+    gpt2_graph_free(&g);
+    i0 = i1;
+  }
+  ok = true;
+
+ out:
+  gpt2_scratch_free(&scratch);
+  free(tokens);
+  free(pos);
+  free(seq);
+  return ok;
+}
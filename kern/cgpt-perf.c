@@ -0,0 +1,2 @@
+#define NUXPERF_DEFINE
+#include "cgpt-perf.h"
@@ -0,0 +1,26 @@
+#include <nux/nuxperf.h>
+
+#ifdef NUXPERF_DECLARE
+#define NUXPERF(_s) extern nuxperf_t __perf _s
+#define NUXMEASURE(_s) extern nuxmeasure_t __measure _s
+#endif
+
+#ifdef NUXPERF_DEFINE
+#define NUXPERF(_s) nuxperf_t __perf _s = { .name = #_s , .val = 0 }
+#define NUXMEASURE(_s) nuxmeasure_t __measure _s = { .name = #_s , 0 }
+#endif
+
+NUXPERF(gpt2_plan_miss);
+NUXPERF(gpt2_prefix_lookups);
+NUXPERF(gpt2_prefix_hits);
+NUXPERF(gpt2_kv_resizes);
+NUXPERF(gpt2_shard_migrations);
+NUXPERF(gpt2_tp_phases);
+
+NUXMEASURE(gpt2_build_us);
+NUXMEASURE(gpt2_compute_us);
+NUXMEASURE(gpt2_prefix_saved_tokens);
+NUXMEASURE(gpt2_ctx_shift_tokens);
+NUXMEASURE(gpt2_beam_shared_rows);
+NUXMEASURE(gpt2_tp_reduce_us);
+NUXMEASURE(gpt2_exec_idle_us);
@@ -0,0 +1,586 @@
+/*
+  Batches of several sequences: the layer pipeline over groups of
+  CPUs and the chunked prefill scheduler that feeds it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nux/nux.h>
+#include <nuxcompute.h>
+#include "ggml.h"
+#include "ggml-alloc.h"
+
+#include "util.h"
+#include "cgpt-common.h"
+#include "cgpt-2.h"
+
+#define NUXPERF_DECLARE
+#include "cgpt-perf.h"
+#include "cgpt-gemv.h"
+#include "cgpt-ggml.h"
+
+/*
+  Layer-pipelined evaluation.
+
+  The layers are split into 'n_stages' contiguous ranges, each run by
+  a group of n_threads/n_stages threads started from its own CPU of
+  the compute pool. A step of several independent batches, one per
+  sequence with its own KV memory, flows through the stages in order:
+  while stage s runs layers of batch m, stage s + 1 runs later layers
+  of batch m - 1. The only synchronization is the hand-off of a
+  [n_embd, N] hidden state between neighbouring stages, and the
+  barriers of each graph only span the threads of one stage.
+
+  The first stage also computes the embeddings, the last one the
+  logits of the last row. Only the plain causal attention is
+  supported.
+*/
+#define GPT2_PP_MAX_STAGES 12
+
+struct gpt2_pp_batch {
+  struct gpt2_kv_cache *kv;
+  int n_past;
+  const int32_t *tokens;
+  int N;
+  struct fvec *logits;
+
+  /* Hand-off between stages. */
+  float *hidden;
+  int stage;
+  bool ok;
+};
+
+struct gpt2_pp;
+
+struct gpt2_pp_stage {
+  struct gpt2_pp *pp;
+  int il0, il1;
+
+  /* Graph memory, allocator, plans and work buffer of the stage. */
+  struct gpt2_scratch s;
+  int64_t t_stall_us; /* Waiting for the previous stage. */
+  int64_t t_busy_us;
+  bool done;
+};
+
+struct gpt2_pp {
+  const struct gpt2_model *model;
+  int n_stages;
+  int n_threads;
+  struct gpt2_pp_stage stages[GPT2_PP_MAX_STAGES];
+
+  struct gpt2_pp_batch *batches;
+  int n_batches;
+};
+
+void
+gpt2_pp_free(struct gpt2_pp *pp)
+{
+  if (pp == NULL)
+    return;
+
+  for (int s = 0; s < pp->n_stages; s++) {
+    struct gpt2_pp_stage *st = pp->stages + s;
+
+    printf("%s: stage %d, layers %d-%d: busy %ld us, stalled %ld us\n", __func__,
+	   s, st->il0, st->il1 - 1, st->t_busy_us, st->t_stall_us);
+    gpt2_scratch_free(&st->s);
+  }
+  free(pp);
+}
+
+struct gpt2_pp *
+gpt2_pp_init(const struct gpt2_model *model, const int n_stages, const int n_threads)
+{
+  const int n_layer = model->hparams.n_layer;
+  struct gpt2_pp *pp;
+
+  if (n_stages < 2 || n_stages > GPT2_PP_MAX_STAGES || n_stages > n_layer
+      || model->flash_attn)
+    return NULL;
+
+  pp = calloc(1, sizeof(*pp));
+  if (pp == NULL)
+    return NULL;
+  pp->model = model;
+  pp->n_stages = n_stages;
+  pp->n_threads = n_threads > n_stages ? n_threads/n_stages : 1;
+  for (int s = 0; s < n_stages; s++) {
+    pp->stages[s].pp = pp;
+    pp->stages[s].il0 = n_layer*s/n_stages;
+    pp->stages[s].il1 = n_layer*(s + 1)/n_stages;
+    if (!gpt2_scratch_init(&pp->stages[s].s)) {
+      gpt2_pp_free(pp);
+      return NULL;
+    }
+  }
+  return pp;
+}
+
+/*
+  The graph of the layers of stage 'st' for N rows after n_past rows of
+  'kv'. Its inputs are the tokens and their positions in the first
+  stage, the hidden state of the previous stage in the others; the
+  ones it does not use are NULL. Returns its output.
+*/
+static struct ggml_tensor *
+gpt2_pp_build(struct ggml_context *ctx0, struct ggml_cgraph *gf,
+	      const struct gpt2_pp_stage *st, const struct gpt2_kv_cache *kv,
+	      const int n_past, const int N,
+	      struct ggml_tensor **embd, struct ggml_tensor **position,
+	      struct ggml_tensor **hidden)
+{
+  const struct gpt2_model *model = st->pp->model;
+  const int n_embd = model->hparams.n_embd;
+  struct ggml_tensor *inpL;
+
+  *embd = NULL;
+  *position = NULL;
+  *hidden = NULL;
+  if (st->il0 == 0) {
+    *embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_set_input(*embd);
+    *position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_set_input(*position);
+
+    // wte + wpe
+    inpL = ggml_add(ctx0,
+		    ggml_get_rows(ctx0, model->wte, *embd),
+		    ggml_get_rows(ctx0, model->wpe, *position));
+  } else {
+    // [768, N]
+    *hidden = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+    ggml_set_input(*hidden);
+    inpL = *hidden;
+  }
+
+  for (int il = st->il0; il < st->il1; il++)
+    inpL = gpt2_build_layer(model, kv, ctx0, gf, il, n_past, N, NULL, inpL);
+
+  if (st->il1 == model->hparams.n_layer) {
+    // [768, 1] -> [50257, 1]
+    inpL = ggml_view_2d(ctx0, inpL, n_embd, 1, inpL->nb[1], (N - 1)*inpL->nb[1]);
+    inpL = gpt2_norm(ctx0, inpL, model->ln_f_g, model->ln_f_b, model->hparams.eps);
+    inpL = gpt2_mul_mat(ctx0, model->lm_head, inpL, model->gemv, model->shards,
+			model->gemm_n);
+  }
+
+  ggml_set_output(inpL);
+  ggml_build_forward_expand(gf, inpL);
+  return inpL;
+}
+
+/*
+  The plan of the stage graph for N rows over 'kv', made once on the
+  graph with the largest n_past, as in gpt2_plan().
+*/
+static struct ggml_cplan *
+gpt2_pp_plan(struct gpt2_pp_stage *st, const struct gpt2_kv_cache *kv, const int N)
+{
+  const struct gpt2_model *model = st->pp->model;
+  const int n_threads = st->pp->n_threads;
+  const int n_past_max = kv->n_ctx_max > N ? kv->n_ctx_max - N : 0;
+  struct ggml_tensor *embd, *position, *hidden;
+  struct ggml_cplan *cplan;
+  struct gpt2_kv_cache wkv;
+  struct ggml_context *ctx;
+  struct ggml_cgraph *gf;
+
+  cplan = gpt2_plan_find(&st->s, model, kv, N, GPT2_LOGITS_LAST, 1, false, n_threads);
+  if (cplan != NULL)
+    return cplan;
+
+  nuxperf_inc(&gpt2_plan_miss);
+
+  ctx = gpt2_plan_ctx(&st->s, kv, &wkv);
+  if (ctx == NULL)
+    return NULL;
+  gf = ggml_new_graph(ctx);
+  gpt2_pp_build(ctx, gf, st, &wkv, n_past_max, N, &embd, &position, &hidden);
+  cplan = gpt2_plan_add(&st->s, model, kv, N, GPT2_LOGITS_LAST, 1, false, gf, n_threads);
+  gpt2_plan_ctx_free(ctx);
+  return cplan;
+}
+
+/*
+  Run the layers of stage 'st' on batch 'b'.
+*/
+static bool
+gpt2_pp_run(struct gpt2_pp_stage *st, struct gpt2_pp_batch *b)
+{
+  const int N = b->N;
+  const bool last = st->il1 == st->pp->model->hparams.n_layer;
+  /* Tensor data is placed by st->s.allocr. */
+  struct ggml_init_params params = {
+    .mem_size   = st->s.size,
+    .mem_buffer = st->s.buf,
+    .no_alloc   = true,
+  };
+  struct ggml_tensor *embd, *position, *hidden, *out;
+  struct ggml_cplan *cplan;
+  struct ggml_context *ctx0;
+  struct ggml_cgraph *gf;
+  bool ok = false;
+
+  cplan = gpt2_pp_plan(st, b->kv, N);
+  if (cplan == NULL)
+    return false;
+
+  ctx0 = ggml_init(params);
+  if (ctx0 == NULL)
+    return false;
+
+  gf = ggml_new_graph(ctx0);
+  out = gpt2_pp_build(ctx0, gf, st, b->kv, b->n_past, N, &embd, &position, &hidden);
+  if (!ggml_gallocr_alloc_graph(st->s.allocr, gf)) {
+    fprintf(stderr, "%s: failed to allocate the compute buffer\n", __func__);
+    ggml_free(ctx0);
+    return false;
+  }
+
+  if (embd) {
+    memcpy(embd->data, b->tokens, N*sizeof(int32_t));
+    for (int i = 0; i < N; i++)
+      ((int32_t *)position->data)[i] = b->n_past + i;
+  } else {
+    memcpy(hidden->data, b->hidden, ggml_nbytes(hidden));
+  }
+
+  GGML_ASSERT(cplan->work_size <= st->s.work_size);
+  cplan->work_data = st->s.work;
+  if (gpt2_ggml_graph_compute(gf, cplan) == GGML_STATUS_SUCCESS) {
+    if (last)
+      fvec_copy_array(b->logits, (float *)out->data, ggml_nelements(out));
+    else
+      memcpy(b->hidden, out->data, ggml_nbytes(out));
+    ok = true;
+  }
+  ggml_free(ctx0);
+  return ok;
+}
+
+static void
+gpt2_pp_stage_loop(void *arg)
+{
+  struct gpt2_pp_stage *st = arg;
+  struct gpt2_pp *pp = st->pp;
+  const int s = st - pp->stages;
+
+  for (int m = 0; m < pp->n_batches; m++) {
+    struct gpt2_pp_batch *b = pp->batches + m;
+    int64_t t_start_us = ggml_time_us();
+
+    while (__atomic_load_n(&b->stage, __ATOMIC_ACQUIRE) != s)
+      hal_cpu_relax();
+    st->t_stall_us += ggml_time_us() - t_start_us;
+
+    t_start_us = ggml_time_us();
+    if (b->ok)
+      b->ok = gpt2_pp_run(st, b);
+    st->t_busy_us += ggml_time_us() - t_start_us;
+
+    __atomic_store_n(&b->stage, s + 1, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&st->done, true, __ATOMIC_RELEASE);
+}
+
+/*
+  Evaluate 'n' independent batches through the stages. Every batch
+  gets the logits of its last row.
+*/
+bool gpt2_pp_eval(struct gpt2_pp *pp, struct gpt2_pp_batch *batches, const int n)
+{
+  const int n_embd = pp->model->hparams.n_embd;
+  unsigned cpu[GPT2_PP_MAX_STAGES];
+  bool ok = true;
+
+  for (int m = 0; m < n; m++) {
+    struct gpt2_pp_batch *b = batches + m;
+
+    // rows are reserved here, stages only write them
+    b->ok = gpt2_kv_reserve(b->kv, b->n_past, b->n_past + b->N);
+    b->hidden = malloc((size_t)b->N*n_embd*sizeof(float));
+    b->ok = b->ok && b->hidden;
+    b->stage = 0;
+  }
+
+  if (n > 0) {
+    pp->batches = batches;
+    pp->n_batches = n;
+
+    for (int s = 1; s < pp->n_stages; s++) {
+      pp->stages[s].done = false;
+      cpu[s] = nuxcompute_allocate_cpu(gpt2_pp_stage_loop, pp->stages + s);
+    }
+    gpt2_pp_stage_loop(pp->stages);
+
+    // a stage only waits for the ones before it: without a CPU, run
+    // it here once these are done
+    for (int s = 1; s < pp->n_stages; s++)
+      if (cpu[s] == CPU_INVALID)
+	gpt2_pp_stage_loop(pp->stages + s);
+    for (int s = 1; s < pp->n_stages; s++) {
+      if (cpu[s] != CPU_INVALID)
+	nuxcompute_wait_cpu(cpu[s]);
+      while (!__atomic_load_n(&pp->stages[s].done, __ATOMIC_ACQUIRE))
+	hal_cpu_relax();
+    }
+  } else {
+    ok = false;
+  }
+
+  for (int m = 0; m < n; m++) {
+    ok = ok && batches[m].ok;
+    free(batches[m].hidden);
+    batches[m].hidden = NULL;
+  }
+  return ok;
+}
+
+/*
+  Chunked prefill scheduler for several sequences.
+
+  Every sequence has its own KV memory. Each step hands out at most
+  'n_step_tokens' tokens: sequences that are generating get one decode
+  token first, the rest of the budget goes to pending prompts in chunks
+  of at most 'n_batch' tokens, shortest remaining prompt first. A long
+  prompt is thus ingested over several steps, while short prompts and
+  running decodes keep making progress.
+
+  A prompt is looked up in the prefix cache 'pc' when first scheduled
+  and inserted in it once evaluated.
+
+  With params->pp_stages, the batches of a step flow through the
+  layer-pipelined stages, see gpt2_pp_eval().
+*/
+struct gpt2_seq {
+  struct gpt2_kv_cache kv;
+
+  int32_t *prompt;
+  int n_prompt;
+  int n_fed;      /* Prompt tokens evaluated or found in the prefix cache. */
+  bool looked_up; /* Prefix cache checked. */
+  int n_sched;    /* Prompt tokens to evaluate in this step. */
+
+  int n_past;
+  int32_t next;   /* Sampled token, not evaluated yet. */
+  struct idvec out;
+  bool done;
+
+  int64_t t_first_us; /* Time to first token. */
+};
+
+static void
+gpt2_seq_sample(const struct gpt2_model *model, const struct gpt_params *params,
+		struct gpt2_seq *seq, struct fvec *logits, unsigned long *rng,
+		int64_t *t_sample_us)
+{
+  const int n_vocab = model->hparams.n_vocab;
+  const int64_t t_start_sample_us = ggml_time_us();
+
+  seq->next = gpt_sample_top_k_top_p(fvec_data(logits) + fvec_size(logits) - n_vocab, n_vocab,
+				     params->top_k, params->top_p, params->temp, rng);
+  *t_sample_us += ggml_time_us() - t_start_sample_us;
+
+  idvec_pushback(&seq->out, seq->next);
+  if ((!params->ignore_eos && seq->next == GPT2_EOS)
+      || (int)idvec_size(&seq->out) >= params->n_predict
+      || (!params->ctx_shift && seq->n_past >= seq->kv.n_ctx_max))
+    seq->done = true;
+}
+
+/*
+  Evaluate the 'n_seq' prompts and generate up to 'n_predict' tokens
+  after each of them, then print every sequence with its time to first
+  token.
+*/
+bool gpt2_schedule(const struct gpt2_model *model,
+		   struct vocab *vocab,
+		   const struct gpt_params *params,
+		   struct gpt2_prefix_cache *pc,
+		   int32_t **prompts,
+		   int *prompt_counts,
+		   const int n_seq,
+		   unsigned long *rng,
+		   int64_t *t_predict_us,
+		   int64_t *t_sample_us)
+{
+  const int n_ctx = params->n_ctx < model->hparams.n_ctx ? params->n_ctx : model->hparams.n_ctx;
+  const int64_t t_start_us = ggml_time_us();
+  struct gpt2_seq *seqs, **batch_seq;
+  struct gpt2_pp_batch *batches;
+  struct gpt2_pp *pp = NULL;
+  struct fvec *logits;
+  size_t mem_per_token = 0;
+  int n_steps = 0;
+  bool ok = true;
+
+  if (params->pp_stages > 1) {
+    pp = gpt2_pp_init(model, params->pp_stages, params->n_threads);
+    if (pp == NULL)
+      fprintf(stderr, "%s: layer pipeline not available, using the full graph\n", __func__);
+  }
+
+  seqs = calloc(n_seq, sizeof(*seqs));
+  batch_seq = calloc(n_seq, sizeof(*batch_seq));
+  batches = calloc(n_seq, sizeof(*batches));
+  logits = calloc(n_seq, sizeof(*logits));
+  for (int i = 0; i < n_seq; i++) {
+    struct gpt2_seq *seq = seqs + i;
+
+    if (!gpt2_kv_init(model, n_ctx, &seq->kv)) {
+      ok = false;
+      break;
+    }
+    seq->prompt = prompts[i];
+    seq->n_prompt = prompt_counts[i] < n_ctx ? prompt_counts[i] : n_ctx;
+    idvec_init(&seq->out);
+    if (seq->n_prompt == 0)
+      seq->done = true;
+  }
+  for (int i = 0; i < n_seq; i++)
+    fvec_init(logits + i);
+
+  while (ok) {
+    int budget = params->n_step_tokens;
+    int n_pending = 0, n_batches = 0;
+    int64_t t_step_us = ggml_time_us();
+
+    /* Decodes first. */
+    for (int i = 0; i < n_seq; i++) {
+      if (!seqs[i].done && seqs[i].n_fed == seqs[i].n_prompt) {
+	budget--;
+      } else if (!seqs[i].done) {
+	n_pending++;
+      }
+      seqs[i].n_sched = 0;
+    }
+    if (n_pending == 0 && budget == params->n_step_tokens)
+      break;
+
+    /* Prompt chunks, shortest remaining prompt first. At least one
+       token goes to prompts, so they are never starved by decodes. */
+    if (budget <= 0 && n_pending > 0)
+      budget = 1;
+    while (budget > 0) {
+      struct gpt2_seq *best = NULL;
+      int chunk;
+
+      for (int i = 0; i < n_seq; i++) {
+	struct gpt2_seq *seq = seqs + i;
+
+	if (seq->done || seq->n_sched || seq->n_fed == seq->n_prompt)
+	  continue;
+	if (!best || seq->n_prompt - seq->n_fed < best->n_prompt - best->n_fed)
+	  best = seq;
+      }
+      if (!best)
+	break;
+
+      if (!best->looked_up) {
+	/* The last prompt token is always evaluated, for its logits. */
+	if (!gpt2_kv_reserve(&best->kv, 0, best->n_prompt)) {
+	  ok = false;
+	  break;
+	}
+	best->n_fed = gpt2_prefix_lookup(pc, &best->kv, best->prompt, best->n_prompt - 1);
+	best->n_past = best->n_fed;
+	best->looked_up = true;
+      }
+
+      chunk = best->n_prompt - best->n_fed;
+      chunk = chunk < params->n_batch ? chunk : params->n_batch;
+      chunk = chunk < budget ? chunk : budget;
+      best->n_sched = chunk;
+      budget -= chunk;
+    }
+
+    /* One batch per sequence. */
+    for (int i = 0; ok && i < n_seq; i++) {
+      struct gpt2_seq *seq = seqs + i;
+      struct gpt2_pp_batch *b = batches + n_batches;
+
+      if (seq->done)
+	continue;
+
+      if (seq->n_fed == seq->n_prompt && seq->n_sched == 0) {
+	/* Decode. */
+	if (seq->n_past >= seq->kv.n_ctx_max) {
+	  const int n_discard = (seq->n_past - params->n_keep)/2;
+
+	  gpt2_kv_shift(&seq->kv, params->n_keep, n_discard, seq->n_past);
+	  seq->n_past -= n_discard;
+	}
+	b->tokens = &seq->next;
+	b->N = 1;
+      } else if (seq->n_sched) {
+	/* Prefill chunk. */
+	b->tokens = seq->prompt + seq->n_fed;
+	b->N = seq->n_sched;
+      } else {
+	continue;
+      }
+      b->kv = &seq->kv;
+      b->n_past = seq->n_past;
+      b->logits = logits + n_batches;
+      batch_seq[n_batches++] = seq;
+    }
+
+    if (pp) {
+      ok = ok && gpt2_pp_eval(pp, batches, n_batches);
+    } else {
+      for (int k = 0; ok && k < n_batches; k++)
+	ok = gpt2_eval(model, batches[k].kv, params->n_threads, batches[k].n_past,
+		       (int32_t *)batches[k].tokens, batches[k].N, GPT2_LOGITS_LAST,
+		       batches[k].logits, &mem_per_token);
+    }
+
+    for (int k = 0; ok && k < n_batches; k++) {
+      struct gpt2_seq *seq = batch_seq[k];
+
+      seq->n_past += batches[k].N;
+      if (seq->n_sched == 0) {
+	gpt2_seq_sample(model, params, seq, batches[k].logits, rng, t_sample_us);
+      } else {
+	seq->n_fed += seq->n_sched;
+	if (seq->n_fed == seq->n_prompt) {
+	  gpt2_prefix_insert(pc, &seq->kv, seq->prompt, seq->n_prompt);
+	  seq->t_first_us = ggml_time_us() - t_start_us;
+	  gpt2_seq_sample(model, params, seq, batches[k].logits, rng, t_sample_us);
+	}
+      }
+    }
+
+    *t_predict_us += ggml_time_us() - t_step_us;
+    n_steps++;
+  }
+
+  for (int i = 0; i < n_seq; i++) {
+    struct gpt2_seq *seq = seqs + i;
+
+    if (seq->kv.ctx == NULL)
+      break;
+
+    printf("%s: seq %d: %d prompt tokens, %zu generated, first token after %ld us\n",
+	   __func__, i, seq->n_prompt, idvec_size(&seq->out), seq->t_first_us);
+    for (int j = 0; j < seq->n_prompt; j++)
+      vocab_print(vocab, seq->prompt[j]);
+    for (size_t j = 0; j < idvec_size(&seq->out); j++)
+      vocab_print(vocab, idvec_data(&seq->out)[j]);
+    printf("\n\n");
+
+    idvec_free(&seq->out);
+    gpt2_kv_free(&seq->kv);
+  }
+  printf("%s: %d steps, %d tokens per step\n", __func__, n_steps, params->n_step_tokens);
+
+  for (int i = 0; i < n_seq; i++)
+    fvec_free(logits + i);
+  free(logits);
+  free(batches);
+  free(batch_seq);
+  free(seqs);
+  gpt2_pp_free(pp);
+  return ok;
+}
@@ -0,0 +1,568 @@
+/*
+  Tensor-parallel evaluation of a GPT-2 graph over groups of CPUs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <nux/nux.h>
+#include <nuxcompute.h>
+#include "ggml.h"
+#include "ggml-alloc.h"
+
+#include "util.h"
+#include "cgpt-common.h"
+#include "cgpt-2.h"
+
+#define NUXPERF_DECLARE
+#include "cgpt-perf.h"
+#include "cgpt-gemv.h"
+#include "cgpt-ggml.h"
+
+/*
+  Tensor-parallel evaluation.
+
+  The heads, the MLP columns and the vocabulary are split among
+  'n_groups' CPU groups. Each group builds and computes its own small
+  graph with 'n_threads' threads, started from a CPU of the compute
+  pool:
+
+   - attention: Q, K and V of its heads, their KV rows and attention,
+     and the product of its columns of c_attn_proj_w, a partial
+     [n_embd, N] sum;
+   - MLP: its columns of c_mlp_fc_w, GELU, and the product of its rows
+     of c_mlp_proj_w, another partial sum;
+   - logits: its rows of lm_head.
+
+  The main CPU reduces the partial sums, adds the bias and residual
+  and computes the layer norms, so there are two synchronizations of
+  all the CPUs per layer instead of a barrier after every node of the
+  whole graph. Only the plain attention path is supported, with
+  causal rows and the logits of the last row.
+
+  The products of a group go through gpt2_mul_mat() on views of the
+  weights, as in the full graph. The weight shards are not used: they
+  hold the rows of the threads of the full graph.
+*/
+#define GPT2_TP_MAX_GROUPS 16
+
+enum gpt2_tp_phase {
+  GPT2_TP_ATTN,
+  GPT2_TP_MLP,
+  GPT2_TP_LOGITS,
+  GPT2_TP_N_PHASES,
+};
+
+struct gpt2_tp;
+
+struct gpt2_tp_group {
+  struct gpt2_tp *tp;
+  int h0, h1; /* Heads. */
+  int f0, f1; /* MLP columns. */
+  int v0, v1; /* Vocabulary rows. */
+
+  /* Graph memory, allocator and work buffer of the group. */
+  struct gpt2_scratch s;
+  /* Plan of each phase, for the model, N and n_ctx_max below. */
+  struct ggml_cplan plans[GPT2_TP_N_PHASES];
+  const struct gpt2_model *plan_model;
+  int plan_N;
+  int plan_n_ctx;
+
+  float *out; /* [n_embd, N] partial sum, or logits of v0..v1. */
+  size_t out_size;
+  bool ok;
+  bool done;
+};
+
+struct gpt2_tp {
+  int n_groups;
+  int n_threads;
+  struct gpt2_tp_group groups[GPT2_TP_MAX_GROUPS];
+
+  /* The current phase. */
+  const struct gpt2_model *model;
+  struct gpt2_kv_cache *kv;
+  enum gpt2_tp_phase phase;
+  int il;
+  int n_past;
+  int N;
+  const float *in; /* [n_embd, N] */
+};
+
+/*
+  Range 'g' of 'n_groups' near equal ranges of 'n' units of 'unit'.
+*/
+static void
+gpt2_tp_split(const int n, const int unit, const int g, const int n_groups, int *i0, int *i1)
+{
+  const int n_units = (n + unit - 1)/unit;
+
+  *i0 = (int)((int64_t)n_units*g/n_groups)*unit;
+  *i1 = (int)((int64_t)n_units*(g + 1)/n_groups)*unit;
+  *i0 = *i0 < n ? *i0 : n;
+  *i1 = *i1 < n ? *i1 : n;
+}
+
+struct gpt2_tp *
+gpt2_tp_init(const struct gpt2_model *model, const int n_groups, const int n_threads)
+{
+  const struct gpt2_hparams *hp = &model->hparams;
+  struct gpt2_tp *tp;
+
+  if (n_groups < 2 || n_groups > GPT2_TP_MAX_GROUPS || n_groups > hp->n_head
+      || model->flash_attn)
+    return NULL;
+
+  tp = calloc(1, sizeof(*tp));
+  tp->n_groups = n_groups;
+  tp->n_threads = n_threads > n_groups ? n_threads/n_groups : 1;
+  for (int g = 0; g < n_groups; g++) {
+    struct gpt2_tp_group *grp = tp->groups + g;
+
+    grp->tp = tp;
+    gpt2_tp_split(hp->n_head, 1, g, n_groups, &grp->h0, &grp->h1);
+    // whole quantization blocks of the c_mlp_proj_w rows
+    gpt2_tp_split(4*hp->n_embd, 64, g, n_groups, &grp->f0, &grp->f1);
+    gpt2_tp_split(hp->n_vocab, 1, g, n_groups, &grp->v0, &grp->v1);
+  }
+  return tp;
+}
+
+void
+gpt2_tp_free(struct gpt2_tp *tp)
+{
+  if (tp == NULL)
+    return;
+
+  for (int g = 0; g < tp->n_groups; g++) {
+    gpt2_scratch_free(&tp->groups[g].s);
+    free(tp->groups[g].out);
+  }
+  free(tp);
+}
+
+/*
+  Attention of heads h0..h1 of layer 'il' for the normalized input 'x'.
+  Returns the partial projection.
+*/
+static struct ggml_tensor *
+gpt2_tp_attn(struct ggml_context *ctx0, struct ggml_cgraph *gf,
+	     const struct gpt2_model *model, const struct gpt2_kv_cache *kv,
+	     const struct gpt2_tp_group *grp, const int il, const int n_past,
+	     struct ggml_tensor *x)
+{
+  const struct gpt2_layer *layer = model->layers + il;
+  const int n_embd = model->hparams.n_embd;
+  const int n_head = model->hparams.n_head;
+  const int hd = n_embd/n_head;
+  const int nh = grp->h1 - grp->h0;
+  const int c0 = grp->h0*hd;
+  const int n_ctx = kv->n_ctx;
+  const int N = x->ne[1];
+  const int n_kv = n_past + N;
+  struct ggml_tensor *w = layer->c_attn_attn_w;
+  struct ggml_tensor *cur[3];
+
+  // cur[i] = attn_w[i*768 + c0 .. + nh*64]*x + attn_b[...]
+  // [nh*64, N]
+  for (int i = 0; i < 3; i++) {
+    cur[i] = gpt2_mul_mat(ctx0, ggml_view_2d(ctx0, w, n_embd, nh*hd, w->nb[1], (i*n_embd + c0)*w->nb[1]), x,
+			  model->gemv, NULL, model->gemm_n);
+    cur[i] = ggml_add_inplace(ctx0, cur[i],
+			      ggml_view_1d(ctx0, layer->c_attn_attn_b, nh*hd, (i*n_embd + c0)*sizeof(float)));
+  }
+
+  // store key and value to memory, columns c0 .. c0 + nh*64
+  {
+    const size_t esize = ggml_element_size(kv->k);
+    struct ggml_tensor * k = ggml_view_2d(ctx0, kv->k, nh*hd, N, esize*n_embd,
+					  esize*(n_embd*(il*n_ctx + n_past) + c0));
+
+    ggml_build_forward_expand(gf, ggml_cpy(ctx0, cur[1], k));
+    if (kv->v_trans) {
+      // [N, nh*64]
+      struct ggml_tensor * v = ggml_view_2d(ctx0, kv->v, N, nh*hd, n_ctx*esize,
+					    esize*(il*n_ctx*n_embd + c0*n_ctx + n_past));
+
+      ggml_build_forward_expand(gf, ggml_cpy(ctx0, ggml_transpose(ctx0, cur[2]), v));
+    } else {
+      struct ggml_tensor * v = ggml_view_2d(ctx0, kv->v, nh*hd, N, esize*n_embd,
+					    esize*(n_embd*(il*n_ctx + n_past) + c0));
+
+      ggml_build_forward_expand(gf, ggml_cpy(ctx0, cur[2], v));
+    }
+  }
+
+  const size_t esize = ggml_element_size(kv->k);
+
+  // [64, N, nh]
+  struct ggml_tensor * Q = ggml_permute(ctx0, ggml_reshape_3d(ctx0, cur[0], hd, nh, N), 0, 2, 1, 3);
+
+  // [64, n_past + N, nh]
+  struct ggml_tensor * K =
+    ggml_permute(ctx0,
+		 ggml_view_3d(ctx0, kv->k, hd, nh, n_kv, esize*hd, esize*n_embd,
+			      esize*(il*n_ctx*n_embd + c0)),
+		 0, 2, 1, 3);
+
+  // [n_past + N, N, nh]
+  struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+  if (!model->folded)
+    KQ = ggml_scale_inplace(ctx0, KQ, 1.0f/sqrt((float)hd));
+  KQ = ggml_soft_max_inplace(ctx0, ggml_diag_mask_inf_inplace(ctx0, KQ, n_past));
+
+  // [n_past + N, 64, nh]
+  struct ggml_tensor * V_trans;
+  if (kv->v_trans) {
+    V_trans = ggml_view_3d(ctx0, kv->v, n_kv, hd, nh, n_ctx*esize, n_ctx*esize*hd,
+			   esize*(il*n_ctx*n_embd + c0*n_ctx));
+  } else {
+    V_trans =
+      ggml_cpy(ctx0,
+	       ggml_permute(ctx0,
+			    ggml_view_3d(ctx0, kv->v, hd, nh, n_kv, esize*hd, esize*n_embd,
+					 esize*(il*n_ctx*n_embd + c0)),
+			    1, 2, 0, 3),
+	       ggml_new_tensor_3d(ctx0, kv->v->type, n_kv, hd, nh));
+  }
+
+  // [64, N, nh] -> [nh*64, N]
+  struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ);
+  struct ggml_tensor * merged =
+    ggml_cpy(ctx0, ggml_permute(ctx0, KQV, 0, 2, 1, 3),
+	     ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, nh*hd, N));
+
+  // proj_w[:, c0 .. c0 + nh*64]*merged
+  // [768, N]
+  w = layer->c_attn_proj_w;
+  return gpt2_mul_mat(ctx0, ggml_view_2d(ctx0, w, nh*hd, n_embd, w->nb[1], ggml_row_size(w->type, c0)),
+		      merged, model->gemv, NULL, model->gemm_n);
+}
+
+/*
+  MLP columns f0..f1 of layer 'il'. Returns the partial projection.
+*/
+static struct ggml_tensor *
+gpt2_tp_mlp(struct ggml_context *ctx0, const struct gpt2_model *model,
+	    const struct gpt2_tp_group *grp, const int il, struct ggml_tensor *x)
+{
+  const struct gpt2_layer *layer = model->layers + il;
+  const int n_embd = model->hparams.n_embd;
+  const int nf = grp->f1 - grp->f0;
+  struct ggml_tensor *w = layer->c_mlp_fc_w;
+  struct ggml_tensor *cur;
+
+  // [nf, N]
+  cur = gpt2_mul_mat(ctx0, ggml_view_2d(ctx0, w, n_embd, nf, w->nb[1], grp->f0*w->nb[1]), x,
+		     model->gemv, NULL, model->gemm_n);
+  cur = ggml_add_inplace(ctx0, cur, ggml_view_1d(ctx0, layer->c_mlp_fc_b, nf, grp->f0*sizeof(float)));
+  cur = ggml_gelu(ctx0, cur);
+
+  // [768, N]
+  w = layer->c_mlp_proj_w;
+  return gpt2_mul_mat(ctx0, ggml_view_2d(ctx0, w, nf, n_embd, w->nb[1], ggml_row_size(w->type, grp->f0)),
+		      cur, model->gemv, NULL, model->gemm_n);
+}
+
+/*
+  The graph of 'phase' of group 'grp', for layer 'il' after n_past rows
+  of 'kv', on the input 'x'. Returns its output.
+*/
+static struct ggml_tensor *
+gpt2_tp_build(struct ggml_context *ctx0, struct ggml_cgraph *gf,
+	      const struct gpt2_model *model, const struct gpt2_kv_cache *kv,
+	      const struct gpt2_tp_group *grp, const enum gpt2_tp_phase phase,
+	      const int il, const int n_past, struct ggml_tensor *x)
+{
+  const int n_embd = model->hparams.n_embd;
+  struct ggml_tensor *w = model->lm_head;
+  struct ggml_tensor *out;
+
+  switch (phase) {
+  case GPT2_TP_ATTN:
+    out = gpt2_tp_attn(ctx0, gf, model, kv, grp, il, n_past, x);
+    break;
+  case GPT2_TP_MLP:
+    out = gpt2_tp_mlp(ctx0, model, grp, il, x);
+    break;
+  default:
+    out = gpt2_mul_mat(ctx0, ggml_view_2d(ctx0, w, n_embd, grp->v1 - grp->v0, w->nb[1], grp->v0*w->nb[1]), x,
+		       model->gemv, NULL, model->gemm_n);
+    break;
+  }
+
+  ggml_set_output(out);
+  ggml_build_forward_expand(gf, out);
+  return out;
+}
+
+static void
+gpt2_tp_run(void *arg)
+{
+  struct gpt2_tp_group *grp = arg;
+  const struct gpt2_tp *tp = grp->tp;
+  const int n_embd = tp->model->hparams.n_embd;
+  /* Tensor data is placed by grp->s.allocr. */
+  struct ggml_init_params params = {
+    .mem_size   = grp->s.size,
+    .mem_buffer = grp->s.buf,
+    .no_alloc   = true,
+  };
+  struct ggml_context *ctx0 = ggml_init(params);
+  struct ggml_cgraph *gf;
+  struct ggml_tensor *x, *out;
+  struct ggml_cplan cplan;
+
+  grp->ok = false;
+  if (ctx0 == NULL)
+    goto out;
+
+  gf = ggml_new_graph(ctx0);
+  x = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, tp->N);
+  ggml_set_input(x);
+  out = gpt2_tp_build(ctx0, gf, tp->model, tp->kv, grp, tp->phase, tp->il, tp->n_past, x);
+
+  if (!ggml_gallocr_alloc_graph(grp->s.allocr, gf)) {
+    fprintf(stderr, "%s: failed to allocate the compute buffer\n", __func__);
+    ggml_free(ctx0);
+    goto out;
+  }
+  memcpy(x->data, tp->in, ggml_nbytes(x));
+
+  cplan = grp->plans[tp->phase];
+  GGML_ASSERT(cplan.work_size <= grp->s.work_size);
+  cplan.work_data = grp->s.work;
+  if (gpt2_ggml_graph_compute(gf, &cplan) == GGML_STATUS_SUCCESS) {
+    memcpy(grp->out, out->data, ggml_nbytes(out));
+    grp->ok = true;
+  }
+  ggml_free(ctx0);
+
+ out:
+  __atomic_store_n(&grp->done, true, __ATOMIC_RELEASE);
+}
+
+/*
+  Run 'phase' on every group: the first one on this CPU, the others on
+  CPUs of the pool, or here too if the pool is empty.
+*/
+static bool
+gpt2_tp_phase(struct gpt2_tp *tp, enum gpt2_tp_phase phase, const int il, const int N, const float *in)
+{
+  unsigned cpu[GPT2_TP_MAX_GROUPS];
+  bool ok = true;
+
+  tp->phase = phase;
+  tp->il = il;
+  tp->N = N;
+  tp->in = in;
+
+  for (int g = 1; g < tp->n_groups; g++) {
+    tp->groups[g].done = false;
+    cpu[g] = nuxcompute_allocate_cpu(gpt2_tp_run, tp->groups + g);
+  }
+  gpt2_tp_run(tp->groups);
+
+  for (int g = 1; g < tp->n_groups; g++) {
+    if (cpu[g] == CPU_INVALID)
+      gpt2_tp_run(tp->groups + g);
+    else
+      nuxcompute_wait_cpu(cpu[g]);
+    while (!__atomic_load_n(&tp->groups[g].done, __ATOMIC_ACQUIRE))
+      hal_cpu_relax();
+  }
+
+  for (int g = 0; g < tp->n_groups; g++)
+    ok = ok && tp->groups[g].ok;
+  nuxperf_inc(&gpt2_tp_phases);
+  return ok;
+}
+
+/*
+  y = g*norm(x) + b for each of the N columns of 'x'. Folded
+  parameters are NULL.
+*/
+static void
+gpt2_tp_norm(const float *x, float *y, const int n, const int N,
+	     const struct ggml_tensor *g, const struct ggml_tensor *b, const float eps)
+{
+  for (int j = 0; j < N; j++) {
+    const float *xj = x + (size_t)j*n;
+    float *yj = y + (size_t)j*n;
+    double mean = 0.0, var = 0.0;
+    float scale;
+
+    for (int i = 0; i < n; i++)
+      mean += xj[i];
+    mean /= n;
+    for (int i = 0; i < n; i++)
+      var += (xj[i] - mean)*(xj[i] - mean);
+    scale = 1.0f/sqrtf(var/n + eps);
+
+    for (int i = 0; i < n; i++) {
+      yj[i] = (xj[i] - mean)*scale;
+      if (g)
+	yj[i] *= ((const float *)g->data)[i];
+      if (b)
+	yj[i] += ((const float *)b->data)[i];
+    }
+  }
+}
+
+/*
+  x += sum of the partial sums of the groups + bias.
+*/
+static void
+gpt2_tp_reduce(const struct gpt2_tp *tp, float *x, const int n, const int N,
+	       const struct ggml_tensor *bias)
+{
+  for (int g = 0; g < tp->n_groups; g++) {
+    const float *p = tp->groups[g].out;
+
+    for (size_t i = 0; i < (size_t)n*N; i++)
+      x[i] += p[i];
+  }
+  for (int j = 0; j < N; j++)
+    for (int i = 0; i < n; i++)
+      x[(size_t)j*n + i] += ((const float *)bias->data)[i];
+}
+
+/*
+  Set up the groups for phases of N rows of tp->model over tp->kv: the
+  output and scratch buffers, and the plan of each phase. As in
+  gpt2_plan(), a plan is made once, on the graph with the largest
+  n_past, and its work buffer fits every step.
+*/
+static bool
+gpt2_tp_reserve(struct gpt2_tp *tp, const int N)
+{
+  const struct gpt2_model *model = tp->model;
+  const struct gpt2_kv_cache *kv = tp->kv;
+  const int n_embd = model->hparams.n_embd;
+  const int n_past_max = kv->n_ctx_max > N ? kv->n_ctx_max - N : 0;
+
+  for (int g = 0; g < tp->n_groups; g++) {
+    struct gpt2_tp_group *grp = tp->groups + g;
+    const int nv = grp->v1 - grp->v0;
+    const size_t out_size = sizeof(float)*((size_t)N*n_embd > (size_t)nv ? (size_t)N*n_embd : (size_t)nv);
+
+    if (!gpt2_scratch_init(&grp->s))
+      return false;
+    if (out_size > grp->out_size) {
+      free(grp->out);
+      grp->out = malloc(out_size);
+      grp->out_size = grp->out ? out_size : 0;
+    }
+    if (grp->out == NULL)
+      return false;
+
+    if (grp->plan_model == model && grp->plan_N == N && grp->plan_n_ctx == kv->n_ctx_max)
+      continue;
+
+    nuxperf_inc(&gpt2_plan_miss);
+    for (int phase = 0; phase < GPT2_TP_N_PHASES; phase++) {
+      struct gpt2_kv_cache wkv;
+      struct ggml_context *ctx = gpt2_plan_ctx(&grp->s, kv, &wkv);
+
+      if (ctx == NULL)
+	return false;
+
+      struct ggml_cgraph *gf = ggml_new_graph(ctx);
+      struct ggml_tensor *x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, N);
+
+      gpt2_tp_build(ctx, gf, model, &wkv, grp, phase, 0, n_past_max, x);
+      grp->plans[phase] = gpt2_ggml_graph_plan(gf, tp->n_threads);
+      gpt2_plan_ctx_free(ctx);
+
+      if (!gpt2_scratch_work(&grp->s, grp->plans[phase].work_size))
+	return false;
+    }
+    grp->plan_model = model;
+    grp->plan_N = N;
+    grp->plan_n_ctx = kv->n_ctx_max;
+  }
+  return true;
+}
+
+/*
+  gpt2_eval() of 'N' tokens with the logits of the last one, split
+  among the groups of 'tp'.
+*/
+bool gpt2_eval_tp(const struct gpt2_model *model,
+		  struct gpt2_kv_cache *kv,
+		  struct gpt2_tp *tp,
+		  const int n_past,
+		  const int32_t *embd_inp,
+		  const int N,
+		  struct fvec *logits)
+{
+  const struct gpt2_hparams *hp = &model->hparams;
+  const int n_embd = hp->n_embd;
+  const int n_vocab = hp->n_vocab;
+  const ggml_type_traits_t wte = ggml_internal_get_type_traits(model->wte->type);
+  float *x, *h, *l;
+  bool ok = false;
+
+  tp->model = model;
+  tp->kv = kv;
+  tp->n_past = n_past;
+  if (N <= 0 || !gpt2_kv_reserve(kv, n_past, n_past + N) || !gpt2_tp_reserve(tp, N))
+    return false;
+
+  x = malloc((size_t)N*n_embd*sizeof(float));
+  h = malloc((size_t)N*n_embd*sizeof(float));
+  l = malloc((size_t)n_vocab*sizeof(float));
+
+  // wte + wpe
+  for (int j = 0; j < N; j++) {
+    const void *row = (const char *)model->wte->data + embd_inp[j]*model->wte->nb[1];
+    const float *pos = (const float *)((const char *)model->wpe->data + (n_past + j)*model->wpe->nb[1]);
+    float *xj = x + (size_t)j*n_embd;
+
+    if (model->wte->type == GGML_TYPE_F32)
+      memcpy(xj, row, n_embd*sizeof(float));
+    else
+      wte.to_float(row, xj, n_embd);
+    for (int i = 0; i < n_embd; i++)
+      xj[i] += pos[i];
+  }
+
+  for (int il = 0; il < hp->n_layer; il++) {
+    const struct gpt2_layer *layer = model->layers + il;
+    int64_t t_start_us;
+
+    gpt2_tp_norm(x, h, n_embd, N, layer->ln_1_g, layer->ln_1_b, hp->eps);
+    if (!gpt2_tp_phase(tp, GPT2_TP_ATTN, il, N, h))
+      goto out;
+
+    t_start_us = ggml_time_us();
+    gpt2_tp_reduce(tp, x, n_embd, N, layer->c_attn_proj_b);
+    gpt2_tp_norm(x, h, n_embd, N, layer->ln_2_g, layer->ln_2_b, hp->eps);
+    nuxmeasure_add(&gpt2_tp_reduce_us, ggml_time_us() - t_start_us);
+
+    if (!gpt2_tp_phase(tp, GPT2_TP_MLP, il, N, h))
+      goto out;
+
+    t_start_us = ggml_time_us();
+    gpt2_tp_reduce(tp, x, n_embd, N, layer->c_mlp_proj_b);
+    nuxmeasure_add(&gpt2_tp_reduce_us, ggml_time_us() - t_start_us);
+  }
+
+  // logits of the last row, each group has a slice of the vocabulary
+  gpt2_tp_norm(x + (size_t)(N - 1)*n_embd, h, n_embd, 1, model->ln_f_g, model->ln_f_b, hp->eps);
+  if (!gpt2_tp_phase(tp, GPT2_TP_LOGITS, 0, 1, h))
+    goto out;
+  for (int g = 0; g < tp->n_groups; g++)
+    memcpy(l + tp->groups[g].v0, tp->groups[g].out,
+	   (tp->groups[g].v1 - tp->groups[g].v0)*sizeof(float));
+  fvec_copy_array(logits, l, n_vocab);
+  ok = true;
+
+ out:
+  free(x);
+  free(h);
+  free(l);
+  return ok;
+}
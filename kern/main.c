@@ -27,6 +27,13 @@ struct hal_umap umap;
 
 int nuxcompute_initialized;
 
+/*
+  APs that ran their XSAVE check, and those that failed it: they are
+  left out of the compute pool.
+*/
+static int ap_checked;
+static bool ap_xsave_failed[HAL_MAXCPUS];
+
 extern void _gpt2_init (void *arg);
 extern void simple_init (void *arg);
 extern void test0_main (int argc, char *argv[]);
@@ -50,8 +57,26 @@ main (int argc, char *argv[])
   nuxcompute_init ();
   cpu_ipi (cpu_id ());
 
+  {
+    const uint64_t xcr0 = nuxcompute_cpu_init ();
+    /* A failed check drops the features it does not keep. */
+    const bool xsave_ok = nuxcompute_xsave_check ();
+    const unsigned features = nuxcompute_cpu_features ();
+
+    printf ("XSAVE: XCR0 %" PRIx64 ", %zu bytes, save/restore %s\n", xcr0,
+	    nuxcompute_xsave_size (), xsave_ok ? "OK" : "FAILED");
+    printf ("CPU features:");
+    for (unsigned i = 0; i < NUXCOMPUTE_CPU_NFEATURES; i++)
+      if (features & (1 << i))
+	printf (" %s", nuxcompute_cpu_feature_name (i));
+    printf ("\n");
+  }
+
+  while (__atomic_load_n (&ap_checked, __ATOMIC_ACQUIRE) < (int)cpu_num() - 1)
+    hal_cpu_relax ();
+
   for (unsigned i = 0; i < cpu_num(); i++)
-    if (i != cpu_id())
+    if (i != cpu_id() && !ap_xsave_failed[i])
       nuxcompute_add_cpu (i);
 
   __atomic_store_n (&nuxcompute_initialized, 1, __ATOMIC_SEQ_CST);
@@ -66,6 +91,15 @@ main (int argc, char *argv[])
 int
 main_ap (void)
 {
+  nuxcompute_cpu_init ();
+  if (!nuxcompute_xsave_check ())
+    {
+      printf ("CPU #%d: XSAVE does not keep the vector state, not used for compute\n",
+	      cpu_id ());
+      ap_xsave_failed[cpu_id ()] = true;
+    }
+  __atomic_add_fetch (&ap_checked, 1, __ATOMIC_RELEASE);
+
   while (!__atomic_load_n (&nuxcompute_initialized, __ATOMIC_SEQ_CST));
 
   return EXIT_IDLE;
@@ -98,6 +132,9 @@ uint64_t ggml_time_us(void);
 uctxt_t *
 entry_alarm (uctxt_t * uctxt)
 {
+  /* May interrupt a kernel that uses the vector registers. */
+  nuxcompute_fpu_save ();
+
   timer_alarm (1 * 1000 * 1000 * 1000);
   info ("TMR: %" PRIu64 " us", timer_gettime ());
   info ("GGML: %" PRIu64 " us", ggml_time_us ());
@@ -105,6 +142,7 @@ entry_alarm (uctxt_t * uctxt)
   nuxperf_print ();
   nuxmeasure_print ();
 
+  nuxcompute_fpu_restore ();
   return uctxt;
 }
 
@@ -127,7 +165,9 @@ entry_pf (uctxt_t * uctxt, vaddr_t va, hal_pfinfo_t pfi)
 uctxt_t *
 entry_irq (uctxt_t * uctxt, unsigned irq, bool lvl)
 {
+  nuxcompute_fpu_save ();
   info ("IRQ %d", irq);
+  nuxcompute_fpu_restore ();
   return uctxt;
 
 }
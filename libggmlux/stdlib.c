@@ -1,12 +1,14 @@
 #include <nux/nux.h>
 #include <nux/nuxperf.h>
 #include <assert.h>
+#include <errno.h>
 #include "stdlib.h"
 
 #define NUXPERF_DECLARE
 #include "perf.h"
 
 #define MAGIC 0x66001DA
+#define ALIGNED_MAGIC 0xA119EDA
 
 struct malloc_header {
   unsigned long magic;
@@ -35,11 +37,27 @@ void *malloc (size_t size)
   return (void *)(ptr+1);
 }
 
+/*
+  Blocks returned by posix_memalign() are preceded by a header with
+  ALIGNED_MAGIC, whose size field points to the underlying malloc()
+  block.
+*/
+static void *aligned_base (void *buf)
+{
+  struct malloc_header *ptr = (struct malloc_header *)buf - 1;
+
+  if (ptr->magic == ALIGNED_MAGIC)
+    return (void *)ptr->size;
+  return buf;
+}
+
 void free (void *buf)
 {
   if (buf == NULL)
     return;
 
+  buf = aligned_base (buf);
+
   struct malloc_header *ptr = (struct malloc_header *)buf - 1;
   if (ptr->magic != MAGIC)
     {
@@ -70,15 +88,17 @@ void *realloc (void *buf, size_t size)
   if (buf == NULL)
     return malloc(size);
 
-  struct malloc_header *ptr = (struct malloc_header *)buf - 1;
+  void *base = aligned_base (buf);
+  struct malloc_header *ptr = (struct malloc_header *)base - 1;
 
   assert (ptr->magic == MAGIC);
   
   /*
     Just reallocate a buffer and copy the content.
   */
+  size_t avail = ptr->size - ((uintptr_t)buf - (uintptr_t)base);
   void *buf2 = malloc (size);
-  memcpy (buf2, buf, size < ptr->size ? size : ptr->size);
+  memcpy (buf2, buf, size < avail ? size : avail);
 
   free(buf);
 
@@ -87,7 +107,30 @@ void *realloc (void *buf, size_t size)
 
 int posix_memalign (void **memptr, size_t alignment, size_t size)
 {
-  (void)alignment; /* Ignore alignment, for now. */
-  *memptr = malloc (size);
+  uintptr_t base, aligned;
+  struct malloc_header *hdr;
+
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+
+  if (alignment <= sizeof (struct malloc_header))
+    {
+      *memptr = malloc (size);
+      return *memptr == NULL ? ENOMEM : 0;
+    }
+
+  base = (uintptr_t) malloc (size + alignment + sizeof (struct malloc_header));
+  if (base == 0)
+    {
+      *memptr = NULL;
+      return ENOMEM;
+    }
+  aligned = (base + sizeof (struct malloc_header) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+  hdr = (struct malloc_header *)aligned - 1;
+  hdr->magic = ALIGNED_MAGIC;
+  hdr->size = base;
+
+  *memptr = (void *)aligned;
   return 0;
 }
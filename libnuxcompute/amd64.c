@@ -1,12 +1,59 @@
+#include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <nux/nux.h>
+#include "nuxcompute.h"
 
-void nc_cpu_init (void)
+/*
+  XSAVE state components (XCR0 bits).
+*/
+#define NC_XCR0_X87		(1 << 0)
+#define NC_XCR0_SSE		(1 << 1)
+#define NC_XCR0_AVX		(1 << 2)
+#define NC_XCR0_OPMASK		(1 << 5)
+#define NC_XCR0_ZMM_HI256	(1 << 6)
+#define NC_XCR0_HI16_ZMM	(1 << 7)
+#define NC_XCR0_TILECFG		(1 << 17)
+#define NC_XCR0_TILEDATA	(1 << 18)
+
+#define NC_XCR0_AVX512 (NC_XCR0_OPMASK | NC_XCR0_ZMM_HI256 | NC_XCR0_HI16_ZMM)
+#define NC_XCR0_AMX (NC_XCR0_TILECFG | NC_XCR0_TILEDATA)
+
+/*
+  Per CPU XSAVE area, for the handlers that interrupt compute code.
+  Handlers do not nest, one is enough.
+*/
+static void *nc_xsave_area[HAL_MAXCPUS];
+static uint64_t nc_xcr0;
+static uint32_t nc_xsave_size;
+
+/*
+  Features whose state the XSAVE check found not kept on some CPU,
+  left out of nuxcompute_cpu_features().
+*/
+static unsigned nc_features_lost;
+
+static void
+nc_cpuid (uint32_t leaf, uint32_t subleaf,
+	  uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+  asm volatile ("cpuid"
+		: "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+		: "a" (leaf), "c" (subleaf));
+}
+
+uint64_t
+nuxcompute_cpu_init (void)
 {
+  uint32_t a, b, c, d;
+  uint64_t xcr0;
+  vaddr_t area;
+
   /*
-    Start AVX and SSE. (INTEL SPECIFIC)
+    Start SSE, and XSAVE if the CPU has it. (INTEL SPECIFIC)
   */
-
-  printf("Enabling SSE/AVX...");
   asm volatile (
 		"mov %%cr0, %%rax\n"
 		"and $~0x8, %%rax\n" /* Clear TS in case. */
@@ -20,13 +67,201 @@ void nc_cpu_init (void)
 		"mov %%cr4, %%rax\n"
 		"or $0x200, %%rax\n"   /* Set OSFXSR */
 		"or $0x400, %%rax\n"   /* Set OSXMMEXCPT */
+		"mov %%rax, %%cr4\n"
+		::: "rax");
+
+  nc_cpuid (1, 0, &a, &b, &c, &d);
+  if (!(c & (1 << 26)))
+    return 0;
+
+  asm volatile (
+		"mov %%cr4, %%rax\n"
 		"or $0x40000, %%rax\n" /* Set OSXSAVE */
 		"mov %%rax, %%cr4\n"
+		::: "rax");
+
+  /*
+    Enable every component we know of that the CPU supports. AVX-512
+    and AMX state can only be enabled as a whole, and AVX-512 needs
+    AVX.
+  */
+  nc_cpuid (0xd, 0, &a, &b, &c, &d);
+  xcr0 = (((uint64_t)d << 32) | a)
+    & (NC_XCR0_X87 | NC_XCR0_SSE | NC_XCR0_AVX | NC_XCR0_AVX512 | NC_XCR0_AMX);
+  if ((xcr0 & NC_XCR0_AVX512) != NC_XCR0_AVX512 || !(xcr0 & NC_XCR0_AVX))
+    xcr0 &= ~(uint64_t)NC_XCR0_AVX512;
+  if ((xcr0 & NC_XCR0_AMX) != NC_XCR0_AMX)
+    xcr0 &= ~(uint64_t)NC_XCR0_AMX;
+  asm volatile ("xsetbv"
+		:: "c" (0), "a" ((uint32_t)xcr0), "d" ((uint32_t)(xcr0 >> 32)));
+
+  /* EBX is now the size of the XSAVE area for what is enabled. */
+  nc_cpuid (0xd, 0, &a, &b, &c, &d);
+  __atomic_store_n (&nc_xcr0, xcr0, __ATOMIC_RELAXED);
+  __atomic_store_n (&nc_xsave_size, b, __ATOMIC_RELAXED);
+
+  /* XRSTOR wants the reserved bytes of the header zero, XSAVE does
+     not write them. */
+  area = kmem_alloc (0, b + 64);
+  assert (area != VADDR_INVALID);
+  area = (area + 63) & ~(vaddr_t)63;
+  memset ((void *)area, 0, b);
+  nc_xsave_area[cpu_id ()] = (void *)area;
+  return xcr0;
+}
+
+size_t
+nuxcompute_xsave_size (void)
+{
+  return nc_xsave_size;
+}
+
+void
+nuxcompute_fpu_save (void)
+{
+  void *area = nc_xsave_area[cpu_id ()];
+
+  if (area != NULL)
+    asm volatile ("xsave64 (%0)"
+		  :: "r" (area), "a" ((uint32_t)nc_xcr0), "d" ((uint32_t)(nc_xcr0 >> 32))
+		  : "memory");
+}
 
-		"xor %%ecx, %%ecx\n" /* XCR0 */
-		"mov $0x7, %%eax\n"  /* Enable x87, SSE, AVX */
-		"xor %%edx, %%edx\n" /* Upper bits empty. */
-		"xsetbv\n"
-		::: "rax", "rcx", "rdx");
-  printf("done\n");
+void
+nuxcompute_fpu_restore (void)
+{
+  void *area = nc_xsave_area[cpu_id ()];
+
+  if (area != NULL)
+    asm volatile ("xrstor64 (%0)"
+		  :: "r" (area), "a" ((uint32_t)nc_xcr0), "d" ((uint32_t)(nc_xcr0 >> 32))
+		  : "memory");
+}
+
+/*
+  Save zmm31 and k7 loaded from 'in' and 'kin', clear them, restore
+  them, store zmm31 to 'out' and return k7. The mask registers can
+  only be clobbered in AVX-512 code.
+*/
+static __attribute__((target ("avx512f"))) uint32_t
+nc_xsave_check_avx512 (void *area, uint32_t lo, uint32_t hi,
+		       const uint64_t *in, uint64_t *out, uint32_t kin)
+{
+  uint32_t kout;
+
+  asm volatile ("vmovdqu64 (%2), %%zmm31\n"
+		"kmovw %3, %%k7\n"
+		"xsave64 (%4)\n"
+		"vpxorq %%zmm31, %%zmm31, %%zmm31\n"
+		"kxorw %%k7, %%k7, %%k7\n"
+		"xrstor64 (%4)\n"
+		"vmovdqu64 %%zmm31, (%1)\n"
+		"kmovw %%k7, %0\n"
+		: "=&r" (kout)
+		: "r" (out), "r" (in), "r" (kin), "r" (area), "a" (lo), "d" (hi)
+		: "xmm31", "k7", "memory");
+  return kout;
+}
+
+/*
+  Check that a save and restore in the area of this CPU keeps the
+  widest vector state enabled: ZMM31 and k7 with AVX-512, else YMM15.
+  Each test is a single asm statement, so that the compiler cannot
+  use these registers in between.
+*/
+bool
+nuxcompute_xsave_check (void)
+{
+  void *area = nc_xsave_area[cpu_id ()];
+  const uint32_t lo = nc_xcr0, hi = nc_xcr0 >> 32;
+  uint64_t in[8], out[8];
+  uint32_t kin = 0xa5c3, kout = 0;
+  bool ok = true;
+
+  if (area == NULL)
+    return true;
+
+  for (int i = 0; i < 8; i++)
+    in[i] = 0x0123456789abcdefULL * (i + 1);
+  memset (out, 0, sizeof (out));
+
+  if ((nc_xcr0 & NC_XCR0_AVX512) == NC_XCR0_AVX512)
+    {
+      kout = nc_xsave_check_avx512 (area, lo, hi, in, out, kin);
+      if (!memcmp (in, out, sizeof (in)) && kin == kout)
+	return true;
+
+      /* Without AVX-512, the AVX state may still be kept. */
+      __atomic_or_fetch (&nc_features_lost, NUXCOMPUTE_CPU_AVX512F
+			 | NUXCOMPUTE_CPU_AVX512BW | NUXCOMPUTE_CPU_AVX512VL,
+			 __ATOMIC_RELAXED);
+      ok = false;
+      memset (out, 0, sizeof (out));
+    }
+
+  if (nc_xcr0 & NC_XCR0_AVX)
+    {
+      asm volatile ("vmovdqu (%1), %%ymm15\n"
+		    "xsave64 (%2)\n"
+		    "vpxor %%xmm15, %%xmm15, %%xmm15\n"
+		    "xrstor64 (%2)\n"
+		    "vmovdqu %%ymm15, (%0)\n"
+		    :: "r" (out), "r" (in), "r" (area), "a" (lo), "d" (hi)
+		    : "xmm15", "memory");
+      if (memcmp (in, out, 4 * sizeof (in[0])))
+	{
+	  __atomic_or_fetch (&nc_features_lost, ~0u, __ATOMIC_RELAXED);
+	  ok = false;
+	}
+    }
+
+  return ok;
+}
+
+static unsigned
+nc_cpu_features (void)
+{
+  uint32_t max, a, b, c, d, c1;
+  uint64_t xcr0;
+  unsigned f = 0;
+
+  nc_cpuid (0, 0, &max, &b, &c, &d);
+  nc_cpuid (1, 0, &a, &b, &c1, &d);
+
+  /* Nothing past SSE without XSAVE enabled by the OS. */
+  if (!(c1 & (1 << 27)))
+    return 0;
+  asm volatile ("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+  xcr0 = ((uint64_t)d << 32) | a;
+
+  /* SSE and AVX state. */
+  if ((xcr0 & 0x6) != 0x6 || !(c1 & (1 << 28)))
+    return 0;
+  f |= NUXCOMPUTE_CPU_AVX;
+  if (c1 & (1 << 12))
+    f |= NUXCOMPUTE_CPU_FMA;
+  if (c1 & (1 << 29))
+    f |= NUXCOMPUTE_CPU_F16C;
+
+  if (max < 7)
+    return f;
+  nc_cpuid (7, 0, &a, &b, &c, &d);
+  if (b & (1 << 5))
+    f |= NUXCOMPUTE_CPU_AVX2;
+
+  /* Opmask, upper ZMM and high ZMM state. */
+  if ((xcr0 & 0xe0) != 0xe0 || !(b & (1 << 16)))
+    return f;
+  f |= NUXCOMPUTE_CPU_AVX512F;
+  if (b & (1 << 30))
+    f |= NUXCOMPUTE_CPU_AVX512BW;
+  if (b & (1u << 31))
+    f |= NUXCOMPUTE_CPU_AVX512VL;
+  return f;
+}
+
+unsigned
+nuxcompute_cpu_features (void)
+{
+  return nc_cpu_features () & ~__atomic_load_n (&nc_features_lost, __ATOMIC_RELAXED);
 }
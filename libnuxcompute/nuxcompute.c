@@ -19,6 +19,7 @@ static struct nc_fnarg {
   void *arg;
 } nc_exe[HAL_MAXCPUS];
 static cpumask_t nc_owned_cpus;
+static unsigned nc_ncpus;
 
 /*
   This is accessed atomically.
@@ -47,8 +48,12 @@ nuxcompute_allocate_cpu (void (*fn)(void *arg), void *arg)
 
   spinlock(&nc_lock);
   cpu = stree_bitsearch (nc_cpus, nc_cpus_order, 1);
-  if (cpu >= 0)
-    stree_clrbit (nc_cpus, nc_cpus_order, cpu);
+  if (cpu < 0)
+    {
+      spinunlock (&nc_lock);
+      return CPU_INVALID;
+    }
+  stree_clrbit (nc_cpus, nc_cpus_order, cpu);
   assert (_nc_cpu_owned (cpu));
   nc_exe[cpu].func = fn;
   nc_exe[cpu].arg = arg;
@@ -58,7 +63,7 @@ nuxcompute_allocate_cpu (void (*fn)(void *arg), void *arg)
   cpu_ipi (cpu);
 
   NCPRINT ("Sallocated cpu %ld\n", cpu);
-  return cpu < 0 ? CPU_INVALID : (unsigned)cpu;
+  return (unsigned)cpu;
 }
 
 void
@@ -86,6 +91,8 @@ nuxcompute_add_cpu (unsigned cpu)
   nc_exe[cpu].func = NULL;
   nc_exe[cpu].arg = NULL;
   stree_setbit (nc_cpus, nc_cpus_order, cpu);
+  if (!cpumask_get (&nc_owned_cpus, cpu))
+    nc_ncpus++;
   cpumask_set (&nc_owned_cpus, cpu);
   spinunlock (&nc_lock);
   NCPRINT ("add cpu %d\n", cpu);
@@ -135,6 +142,64 @@ nuxcompute_cpu_owned (unsigned cpu)
   return ret;
 }
 
+unsigned
+nuxcompute_cpu_count (void)
+{
+  unsigned n;
+
+  spinlock (&nc_lock);
+  n = nc_ncpus;
+  spinunlock (&nc_lock);
+
+  return n;
+}
+
+#ifndef __x86_64__
+unsigned
+nuxcompute_cpu_features (void)
+{
+  return 0;
+}
+
+uint64_t
+nuxcompute_cpu_init (void)
+{
+  return 0;
+}
+
+size_t
+nuxcompute_xsave_size (void)
+{
+  return 0;
+}
+
+void
+nuxcompute_fpu_save (void)
+{
+}
+
+void
+nuxcompute_fpu_restore (void)
+{
+}
+
+bool
+nuxcompute_xsave_check (void)
+{
+  return true;
+}
+#endif
+
+const char *
+nuxcompute_cpu_feature_name (unsigned bit)
+{
+  static const char *names[NUXCOMPUTE_CPU_NFEATURES] = {
+    "avx", "fma", "f16c", "avx2", "avx512f", "avx512bw", "avx512vl",
+  };
+
+  return bit < NUXCOMPUTE_CPU_NFEATURES ? names[bit] : "?";
+}
+
 void
 nuxcompute_init (void)
 {
@@ -10,10 +10,54 @@ void nuxcompute_wait_cpu (unsigned cpu);
 
 bool nuxcompute_cpu_owned (unsigned cpu);
 
+/* CPUs added to the pool. */
+unsigned nuxcompute_cpu_count (void);
+
 bool nuxcompute_start (void (*init)(void *), void *arg);
 void nuxcompute_stop (void);
 
 void nuxcompute_cpu_run (void);
 void nuxcompute_init (void);
 
+/*
+  Vector features of the CPU that compute code can use: present in
+  CPUID, with their register state enabled in XCR0, and kept by the
+  save and restore of every CPU checked so far.
+*/
+#define NUXCOMPUTE_CPU_AVX	(1 << 0)
+#define NUXCOMPUTE_CPU_FMA	(1 << 1)
+#define NUXCOMPUTE_CPU_F16C	(1 << 2)
+#define NUXCOMPUTE_CPU_AVX2	(1 << 3)
+#define NUXCOMPUTE_CPU_AVX512F	(1 << 4)
+#define NUXCOMPUTE_CPU_AVX512BW	(1 << 5)
+#define NUXCOMPUTE_CPU_AVX512VL	(1 << 6)
+#define NUXCOMPUTE_CPU_NFEATURES 7
+
+unsigned nuxcompute_cpu_features (void);
+const char *nuxcompute_cpu_feature_name (unsigned bit);
+
+/*
+  Enable the vector state of the calling CPU: every XSAVE component
+  the CPU supports among x87, SSE, AVX, AVX-512 and AMX. Run on every
+  CPU before it computes. Returns XCR0, 0 without XSAVE.
+*/
+uint64_t nuxcompute_cpu_init (void);
+
+/* Bytes that XSAVE writes for the enabled components. */
+size_t nuxcompute_xsave_size (void);
+
+/*
+  Save and restore the vector state of the calling CPU around code
+  that interrupts compute code. Does not nest.
+*/
+void nuxcompute_fpu_save (void);
+void nuxcompute_fpu_restore (void);
+
+/*
+  Whether save and restore keep the widest enabled registers. The
+  features whose registers are not kept, AVX-512 only if the AVX
+  registers are, are no longer reported by nuxcompute_cpu_features().
+*/
+bool nuxcompute_xsave_check (void);
+
 #endif /* _NUXCOMPUTE_H */